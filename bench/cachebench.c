@@ -0,0 +1,223 @@
+/*
+ * cachebench.c - Measure how cache lookups scale with threads.
+ *
+ * Threads look keys up in the proxy's cache and copy the object out, as a
+ * memory hit does, and replace a share of them with cache_insert(), as a
+ * fill does. Lookups run either under the cache mutex, the way the proxy used
+ * to serve hits, or inside RCU read-side sections with no lock at all. Fills
+ * always build the block outside the mutex and release evictions after it.
+ *
+ * One row is printed per mode and thread count, with lookups and fills per
+ * second over the whole run.
+ *
+ * usage: cachebench [-t threads,...] [-d seconds] [-w fill%] [-k keys]
+ *                   [-s size]
+ */
+
+#include "cache.h"
+#include "rcu.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_RUNS 16
+
+/* Work done by one thread */
+typedef struct {
+    pthread_t tid;
+    unsigned long seed;    // Per-thread random state
+    unsigned long lookups; // Lookups done
+    unsigned long hits;    // Lookups that found the key
+    unsigned long fills;   // Inserts done
+} worker_t;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int use_rcu;
+static int stop;
+static int fill_percent = 10;
+static int nkeys = 512;
+static size_t object_size = 4096;
+/* Source of every web object */
+static char object[MAX_OBJECT_SIZE];
+
+/*
+ * next_random - xorshift, cheap enough not to show up in the results
+ */
+static unsigned long next_random(unsigned long *state) {
+    unsigned long x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/*
+ * fill - insert a key the way the proxy does after fetching it
+ */
+static void fill(char *key) {
+    block_t *block = block_init(key, object, object_size);
+    retired_t retired;
+
+    if (block == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    cache_insert(block, &retired);
+    pthread_mutex_unlock(&mutex);
+    cache_release(&retired);
+}
+
+/*
+ * lookup - serve a key from the cache into a private buffer
+ */
+static int lookup(char *key, char *buf) {
+    block_t *block;
+    int epoch = 0;
+
+    if (use_rcu) {
+        epoch = rcu_read_lock();
+    } else {
+        pthread_mutex_lock(&mutex);
+    }
+    block = search_cache(key);
+    if (block != NULL) {
+        memcpy(buf, block->value, block->value_length);
+    }
+    if (use_rcu) {
+        rcu_read_unlock(epoch);
+    } else {
+        pthread_mutex_unlock(&mutex);
+    }
+    return block != NULL;
+}
+
+/*
+ * work - thread routine, runs lookups and fills until told to stop
+ */
+static void *work(void *arg) {
+    worker_t *w = arg;
+    char key[MAXLINE];
+    char *buf = malloc(MAX_OBJECT_SIZE);
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        unsigned long r = next_random(&w->seed);
+
+        snprintf(key, sizeof(key), "http://bench/%lu", (r >> 8) % nkeys);
+        if ((int)(r % 100) < fill_percent) {
+            fill(key);
+            w->fills++;
+        } else {
+            w->hits += lookup(key, buf);
+            w->lookups++;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * run - time one mode at one thread count and print a row
+ */
+static void run(int rcu, int nthreads, int seconds) {
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    unsigned long lookups = 0, hits = 0, fills = 0;
+    struct timespec start, end;
+    double elapsed;
+    char key[MAXLINE];
+    int i;
+
+    cache_init();
+    cache_set_capacity(MAX_CACHE_SIZE);
+    for (i = 0; i < nkeys; i++) {
+        snprintf(key, sizeof(key), "http://bench/%d", i);
+        fill(key);
+    }
+    use_rcu = rcu;
+    stop = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nthreads; i++) {
+        workers[i].seed = 88172645463325252UL + i * 2654435761UL;
+        pthread_create(&workers[i].tid, NULL, work, &workers[i]);
+    }
+    sleep(seconds);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        lookups += workers[i].lookups;
+        hits += workers[i].hits;
+        fills += workers[i].fills;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%-6s %8d %14.0f %8.2f %12.0f\n", rcu ? "rcu" : "mutex", nthreads,
+           lookups / elapsed, lookups ? 100.0 * hits / lookups : 0.0,
+           fills / elapsed);
+    cache_free();
+    free(workers);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-t threads,...] [-d seconds] [-w fill%%] [-k keys]"
+            " [-s size]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int threads[MAX_RUNS] = {1, 2, 4, 8};
+    int nthreads = 4, seconds = 3;
+    char *item;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "t:d:w:k:s:")) != -1) {
+        switch (c) {
+        case 't':
+            nthreads = 0;
+            for (item = strtok(optarg, ","); item != NULL;
+                 item = strtok(NULL, ",")) {
+                if (nthreads == MAX_RUNS || atoi(item) <= 0) {
+                    usage(argv[0]);
+                }
+                threads[nthreads++] = atoi(item);
+            }
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'w':
+            fill_percent = atoi(optarg);
+            break;
+        case 'k':
+            nkeys = atoi(optarg);
+            break;
+        case 's':
+            object_size = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nthreads == 0 || seconds <= 0 || nkeys <= 0 ||
+        object_size > MAX_OBJECT_SIZE || fill_percent < 0 ||
+        fill_percent > 100) {
+        usage(argv[0]);
+    }
+
+    printf("%-6s %8s %14s %8s %12s\n", "mode", "threads", "lookups/s", "hit%",
+           "fills/s");
+    for (i = 0; i < nthreads; i++) {
+        run(0, threads[i], seconds);
+        run(1, threads[i], seconds);
+    }
+    return 0;
+}
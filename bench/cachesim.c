@@ -0,0 +1,357 @@
+/*
+ * cachesim.c - Replay an access trace through the proxy's cache.
+ *
+ * The trace has one access per line, "uri size [timestamp]", separated by
+ * spaces, tabs or commas; lines starting with '#' are skipped. This is the
+ * format the proxy writes with -L. Each access is looked up with
+ * search_cache() and, on a miss, inserted with cache_insert() exactly as the
+ * proxy does, so objects larger than MAX_OBJECT_SIZE are never cached. No
+ * sockets are involved; the replay also serves as a cache microbenchmark.
+ *
+ * Every combination of policy and capacity is replayed from a cold cache
+ * and reported as one row.
+ *
+ * With -V, no trace is read: each policy instead checks that a vary marker
+ * is not evicted while its variants are cached, and that it counts them
+ * exactly across being evicted and inserted again.
+ *
+ * usage: cachesim [-p policy,...] [-c capacity,...] [-r repeat] trace
+ *        cachesim -V [-p policy,...]
+ */
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_RUNS 16
+
+/* One access in the trace */
+typedef struct {
+    char *uri;   // Key of the object
+    size_t size; // Bytes served
+} access_t;
+
+/* A replacement policy the cache can run */
+typedef struct {
+    const char *name;
+    void (*select)(void); // Switches the cache to this policy
+} policy_t;
+
+static void select_lru(void) {
+    cache_set_policy(CACHE_LRU);
+}
+
+static void select_clock(void) {
+    cache_set_policy(CACHE_CLOCK);
+}
+
+static const policy_t policies[] = {
+    {"lru", select_lru},
+    {"clock", select_clock},
+};
+#define NPOLICIES (sizeof(policies) / sizeof(policies[0]))
+
+static access_t *trace;
+static size_t ntrace;
+static unsigned long evictions;
+/* Source of every web object, the simulator only cares about sizes */
+static char object[MAX_OBJECT_SIZE];
+
+/*
+ * count_eviction - evict hook counting the blocks the policy drops
+ */
+static void count_eviction(const char *key, const char *value,
+                           size_t length) {
+    (void)key;
+    (void)value;
+    (void)length;
+    evictions++;
+}
+
+/*
+ * parse_size - parse a byte count with an optional K, M or G suffix
+ */
+static size_t parse_size(const char *arg) {
+    char *end;
+    size_t size = strtoull(arg, &end, 10);
+
+    switch (*end) {
+    case 'G':
+    case 'g':
+        size <<= 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        size <<= 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        size <<= 10;
+        end++;
+        break;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+/*
+ * load_trace - read the whole trace into memory
+ */
+static void load_trace(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char line[MAXLINE + 64];
+    size_t capacity = 0, lineno = 0;
+    char *uri, *size;
+
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        uri = strtok(line, " \t,\r\n");
+        if (uri == NULL || uri[0] == '#') {
+            continue;
+        }
+        size = strtok(NULL, " \t,\r\n");
+        if (size == NULL || strlen(uri) >= MAXLINE) {
+            fprintf(stderr, "%s:%zu: malformed access\n", path, lineno);
+            continue;
+        }
+        if (ntrace == capacity) {
+            capacity = capacity ? 2 * capacity : 4096;
+            trace = realloc(trace, capacity * sizeof(access_t));
+            if (trace == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        trace[ntrace].uri = strdup(uri);
+        trace[ntrace].size = strtoull(size, NULL, 10);
+        ntrace++;
+    }
+    fclose(fp);
+}
+
+/*
+ * replay - run the trace through a cold cache and print one row
+ */
+static void replay(const policy_t *policy, size_t capacity, int repeat) {
+    char key[MAXLINE] = "";
+    retired_t retired;
+    unsigned long hits = 0;
+    unsigned long long bytes = 0, hit_bytes = 0;
+    struct timespec start, end;
+    double seconds;
+    size_t i;
+    int r;
+
+    cache_init();
+    cache_set_capacity(capacity);
+    policy->select();
+    evictions = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (r = 0; r < repeat; r++) {
+        for (i = 0; i < ntrace; i++) {
+            strcpy(key, trace[i].uri);
+            bytes += trace[i].size;
+            if (search_cache(key) != NULL) {
+                hits++;
+                hit_bytes += trace[i].size;
+            } else if (trace[i].size <= MAX_OBJECT_SIZE) {
+                cache_insert(block_init(key, object, trace[i].size),
+                             &retired);
+                cache_release(&retired);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%-8s %12zu %10zu %8.2f %9.2f %10lu %12.0f\n", policy->name,
+           capacity, ntrace * repeat, 100.0 * hits / (ntrace * repeat),
+           bytes ? 100.0 * hit_bytes / bytes : 0.0, evictions,
+           ntrace * repeat / seconds);
+    cache_free();
+}
+
+/*
+ * insert - insert a block of a kind, 1 if the cache took it
+ */
+static int insert(char *key, size_t size, block_kind_t kind) {
+    block_t *block = block_init(key, object, size);
+    retired_t retired;
+    int inserted;
+
+    block->kind = kind;
+    cache_insert(block, &retired);
+    inserted = retired.rejected == NULL;
+    cache_release(&retired);
+    return inserted;
+}
+
+/* What the vary check finds in the cache */
+typedef struct {
+    block_t *marker; // The vary marker, NULL if it is not cached
+    int variants;    // Its variants cached
+} vary_state_t;
+
+static void find_vary(block_t *block, void *arg) {
+    vary_state_t *state = arg;
+
+    if (block->kind == BLOCK_VARY) {
+        state->marker = block;
+    } else if (block->kind == BLOCK_VARIANT) {
+        state->variants++;
+    }
+}
+
+/*
+ * check_vary - evict a vary marker's variants around it, twice
+ *
+ * The marker is the oldest block, so it would be the first evicted if it
+ * were not held until its variants are gone. The second round inserts it
+ * again and must still be held to MAX_VARIANTS variants.
+ */
+static int check_vary(const policy_t *policy) {
+    char key[MAXLINE];
+    int failures = 0;
+    int round, i;
+
+    cache_init();
+    cache_set_capacity(8 * 1024);
+    policy->select();
+    for (round = 0; round < 2; round++) {
+        vary_state_t before = {NULL, 0};
+
+        /*inserted again unless the policy kept it through the last round*/
+        cache_walk(find_vary, &before);
+        strcpy(key, "http://vary/");
+        if (insert(key, 16, BLOCK_VARY) != (before.marker == NULL)) {
+            printf("%s: round %d: marker %s\n", policy->name, round,
+                   before.marker == NULL ? "rejected" : "inserted twice");
+            failures++;
+        }
+        for (i = 0; i <= MAX_VARIANTS; i++) {
+            snprintf(key, sizeof(key), "http://vary/\n%d-%d", round, i);
+            if (insert(key, 512, BLOCK_VARIANT) != (i < MAX_VARIANTS)) {
+                printf("%s: round %d: variant %d %s\n", policy->name, round,
+                       i, i < MAX_VARIANTS ? "rejected" : "accepted");
+                failures++;
+            }
+        }
+        /*push everything out, checking the count after every eviction*/
+        for (i = 0; i < 32; i++) {
+            vary_state_t state = {NULL, 0};
+
+            snprintf(key, sizeof(key), "http://fill/%d-%d", round, i);
+            insert(key, 1024, BLOCK_OBJECT);
+            cache_walk(find_vary, &state);
+            if (state.marker == NULL
+                    ? state.variants > 0
+                    : state.marker->variants != state.variants) {
+                printf("%s: round %d: %d variants cached, marker counts %d\n",
+                       policy->name, round, state.variants,
+                       state.marker == NULL ? -1 : state.marker->variants);
+                failures++;
+                break;
+            }
+        }
+    }
+    cache_free();
+    printf("%-8s vary check %s\n", policy->name, failures ? "FAILED" : "ok");
+    return failures;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-p policy,...] [-c capacity,...] [-r repeat] trace\n"
+            "       %s -V [-p policy,...]\n",
+            prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const policy_t *selected[MAX_RUNS];
+    size_t capacities[MAX_RUNS];
+    int npolicies = 0, ncapacities = 0, repeat = 1, check = 0;
+    char *item;
+    size_t p;
+    int c, i, j;
+
+    while ((c = getopt(argc, argv, "p:c:r:V")) != -1) {
+        switch (c) {
+        case 'p':
+            for (item = strtok(optarg, ","); item != NULL;
+                 item = strtok(NULL, ",")) {
+                for (p = 0; p < NPOLICIES; p++) {
+                    if (strcmp(item, policies[p].name) == 0) {
+                        break;
+                    }
+                }
+                if (p == NPOLICIES || npolicies == MAX_RUNS) {
+                    fprintf(stderr, "unknown policy %s\n", item);
+                    usage(argv[0]);
+                }
+                selected[npolicies++] = &policies[p];
+            }
+            break;
+        case 'c':
+            for (item = strtok(optarg, ","); item != NULL;
+                 item = strtok(NULL, ",")) {
+                if (ncapacities == MAX_RUNS ||
+                    (capacities[ncapacities++] = parse_size(item)) == 0) {
+                    usage(argv[0]);
+                }
+            }
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'V':
+            check = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != !check || repeat < 1) {
+        usage(argv[0]);
+    }
+    if (npolicies == 0) {
+        for (p = 0; p < NPOLICIES; p++) {
+            selected[npolicies++] = &policies[p];
+        }
+    }
+    if (check) {
+        int failures = 0;
+        for (i = 0; i < npolicies; i++) {
+            failures += check_vary(selected[i]);
+        }
+        return failures ? 1 : 0;
+    }
+    if (ncapacities == 0) {
+        capacities[ncapacities++] = MAX_CACHE_SIZE;
+    }
+
+    load_trace(argv[optind]);
+    if (ntrace == 0) {
+        fprintf(stderr, "%s: no accesses\n", argv[optind]);
+        exit(1);
+    }
+    cache_set_evict_hook(count_eviction);
+
+    printf("%-8s %12s %10s %8s %9s %10s %12s\n", "policy", "capacity",
+           "requests", "hit%", "bytehit%", "evictions", "ops/s");
+    for (i = 0; i < npolicies; i++) {
+        for (j = 0; j < ncapacities; j++) {
+            replay(selected[i], capacities[j], repeat);
+        }
+    }
+    return 0;
+}
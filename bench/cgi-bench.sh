@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+#
+# cgi-bench.sh - compare tiny's dynamic request throughput with and without
+#                persistent CGI workers
+#
+# usage: bench/cgi-bench.sh [workers [loadgen options]]
+#
+# Drives tiny directly with loadgen, once forking cgi-bin/adder for every
+# request and once passing requests to a pool of adder workers (tiny -w).
+
+dir=$(cd "$(dirname "$0")" && pwd)
+workers=${1:-4}
+shift
+args=${*:--c 16 -d 5 -w 1}
+
+if [ ! -x "${dir}/../tiny/tiny" ] || [ ! -x "${dir}/loadgen" ]; then
+  echo "build tiny and bench first"
+  exit 1
+fi
+
+run() {
+  local port=$(( (RANDOM % 20000) + 20000 ))
+  (cd "${dir}/../tiny" && exec ./tiny -t "$@" ${port} > /dev/null 2>&1) &
+  local pid=$!
+  for attempt in $(seq 50); do
+    if (exec 3<>/dev/tcp/localhost/${port}) 2>/dev/null; then
+      break
+    fi
+    sleep 0.1
+  done
+  "${dir}/loadgen" -x localhost:${port} -e localhost:${port} \
+    -u '/cgi-bin/adder?1&2' ${args} | awk '/^requests/ {print $5}'
+  kill ${pid}
+  wait ${pid} 2>/dev/null
+}
+
+fork=$(run)
+pool=$(run -w "${workers}")
+printf "%-24s %12s\n" "cgi mode" "requests/s"
+printf "%-24s %12s\n" "fork per request" "${fork}"
+printf "%-24s %12s\n" "${workers} persistent workers" "${pool}"
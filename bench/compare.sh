@@ -0,0 +1,27 @@
+#!/usr/bin/env bash
+#
+# compare.sh - benchmark several proxy builds with the same load
+#
+# usage: bench/compare.sh <proxy> <proxy>...
+#
+# The first proxy is the reference; the others are reported as a change
+# in requests/s relative to it.  BENCH_ARGS are passed to loadgen.
+
+dir=$(dirname "$0")
+args=${BENCH_ARGS:--d 10 -w 2 -c 32}
+reference=""
+
+printf "%-24s %12s %10s %10s\n" "proxy" "requests/s" "p99 us" "change"
+for proxy in "$@"; do
+  out=$("${dir}/run-bench.sh" "${proxy}" ${args})
+  rate=$(echo "${out}" | awk '/^requests/ {print $5}')
+  p99=$(echo "${out}" | awk '/^latency/ {for (i = 1; i < NF; i++) if ($i == "p99") print $(i + 1)}')
+  if [ -z "${reference}" ]; then
+    reference=${rate}
+    change="-"
+  else
+    change=$(awk -v r="${rate}" -v b="${reference}" \
+      'BEGIN {printf "%+.1f%%", 100 * (r - b) / b}')
+  fi
+  printf "%-24s %12s %10s %10s\n" "${proxy}" "${rate}" "${p99}" "${change}"
+done
@@ -0,0 +1,55 @@
+#!/usr/bin/env bash
+#
+# idle-rss.sh - measure the proxy's resident memory per idle connection
+#
+# usage: bench/idle-rss.sh [proxy [connections]]
+#
+# Starts the proxy, warms it up with a short loadgen run so that thread
+# stacks and buffers have been used once, then opens idle connections that
+# never send a request and reports how much the resident set grew, scaled
+# to 1000 connections.
+
+dir=$(dirname "$0")
+proxy=${1:-${dir}/../proxy}
+count=${2:-1000}
+
+if [ ! -x "${proxy}" ] || [ ! -x "${dir}/loadgen" ]; then
+  echo "usage: $0 [proxy [connections]]"
+  exit 1
+fi
+
+for attempt in $(seq 20); do
+  port=$(( (RANDOM % 20000) + 20000 ))
+  if ! (exec 3<>/dev/tcp/localhost/${port}) 2>/dev/null; then
+    break
+  fi
+done
+
+"${proxy}" ${PROXY_ARGS} ${port} > /dev/null 2>&1 &
+pid=$!
+trap 'kill ${pid} 2>/dev/null' EXIT
+for attempt in $(seq 50); do
+  if (exec 3<>/dev/tcp/localhost/${port}) 2>/dev/null; then
+    break
+  fi
+  sleep 0.1
+done
+
+rss() {
+  awk '/^VmRSS/ {print $2}' /proc/${pid}/status
+}
+
+"${dir}/loadgen" -x localhost:${port} -d 3 -w 0 -c 32 > /dev/null
+sleep 0.5
+before=$(rss)
+for i in $(seq "${count}"); do
+  exec {fd}<>/dev/tcp/localhost/${port}
+done
+sleep 1
+after=$(rss)
+threads=$(awk '/^Threads/ {print $2}' /proc/${pid}/status)
+
+echo "idle connections ${count}, threads ${threads}"
+echo "rss before ${before} kB, after ${after} kB"
+awk -v a="${after}" -v b="${before}" -v n="${count}" \
+  'BEGIN {printf "rss per 1k idle connections %.0f kB\n", (a - b) * 1000 / n}'
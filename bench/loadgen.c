@@ -0,0 +1,635 @@
+/*
+ * loadgen.c - A closed-loop HTTP load generator for the proxy.
+ *
+ * Each worker thread drives its share of the connections with epoll. A
+ * connection sends one HTTP/1.0 GET through the proxy, reads the response
+ * until the proxy closes it, records the latency and starts over with the
+ * next object. Objects are drawn from a Zipf distribution over -n ids, and
+ * each id has a fixed size drawn log-uniformly from the -s range, so the
+ * same id always names the same bytes.
+ *
+ * Unless -e names an external origin, loadgen also runs the origin itself: a
+ * static responder serving /obj/<id>-<size> with <size> bytes. Counting the
+ * requests that reach it gives the proxy's hit ratio.
+ *
+ * With -u, every request asks the external origin for the same path
+ * instead, e.g. a CGI program; -x may then name the origin itself.
+ *
+ * usage: loadgen -x proxyhost:port [-e originhost:port] [-o originport]
+ *                [-c conns] [-t threads] [-d seconds] [-w seconds]
+ *                [-n objects] [-z skew] [-s min:max] [-u path]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+#define REQLEN 512
+#define HEADLEN 256
+#define READLEN 65536
+/* Largest object the responder serves */
+#define MAX_BODY (4 << 20)
+#define RESPONDERS 4
+
+/* Latency histogram: 32 linear sub-buckets per power of two microseconds */
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+typedef enum { CONN_IDLE, CONN_CONNECTING, CONN_SENDING, CONN_READING } phase_t;
+
+/* One client connection driven by a worker */
+typedef struct {
+    int fd;                 // Socket, -1 between requests
+    phase_t phase;          // Where the request is
+    char request[REQLEN];   // Request being sent
+    size_t request_len;     // Length of request
+    size_t sent;            // Bytes of request sent
+    char head[HEADLEN];     // Start of the response, for checking
+    size_t head_len;        // Bytes saved in head
+    size_t received;        // Bytes of response received
+    size_t expected;        // Body size the object should have
+    struct timespec start;  // When the request started
+} conn_t;
+
+/* Per-worker statistics, merged when the run ends */
+typedef struct {
+    uint64_t hist[BUCKETS]; // Latency histogram
+    uint64_t requests;      // Completed requests
+    uint64_t errors;        // Failed requests
+    uint64_t bytes;         // Response bytes received
+    uint64_t max_us;        // Slowest request
+} stats_t;
+
+typedef struct {
+    pthread_t tid;
+    int first;              // Index of the first connection
+    int count;              // Number of connections
+    uint64_t rng;           // xorshift state
+    stats_t stats;
+} worker_t;
+
+/* Configuration */
+static char proxy_host[256], proxy_port[16];
+static char origin_host[256] = "localhost", origin_port[16] = "0";
+static bool external_origin = false;
+static const char *fixed_path = NULL;
+static int nconns = 32, nthreads = 4;
+static int duration = 10, warmup = 2;
+static long nobjects = 1000;
+static double skew = 0.99;
+static size_t min_size = 512, max_size = 65536;
+
+static struct addrinfo *proxy_addr;
+static double *zipf_cdf;
+static conn_t *conns;
+static worker_t workers[MAX_THREADS];
+static volatile int measuring = 0, stopping = 0;
+static uint64_t origin_requests = 0;
+static char body[MAX_BODY];
+
+/*
+ * elapsed_us - microseconds since a monotonic timestamp
+ */
+static uint64_t elapsed_us(const struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - since->tv_sec) * 1000000 +
+           (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/*
+ * bucket_of - histogram bucket of a latency
+ */
+static int bucket_of(uint64_t us) {
+    int msb;
+
+    if (us < SUB_COUNT) {
+        return (int)us;
+    }
+    msb = 63 - __builtin_clzll(us);
+    return (msb - SUB_BITS + 1) * SUB_COUNT +
+           (int)((us >> (msb - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/*
+ * bucket_value - largest latency that falls in a bucket
+ */
+static uint64_t bucket_value(int bucket) {
+    int shift;
+
+    if (bucket < SUB_COUNT) {
+        return bucket;
+    }
+    shift = bucket / SUB_COUNT - 1;
+    return (((uint64_t)SUB_COUNT + bucket % SUB_COUNT + 1) << shift) - 1;
+}
+
+/*
+ * next_random - xorshift64*, returns a value in [0, 1)
+ */
+static double next_random(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (double)((x * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+/*
+ * object_size - the fixed size of an object, log-uniform in the size range
+ */
+static size_t object_size(long id) {
+    uint64_t h = (uint64_t)id * 0x9E3779B97F4A7C15ULL;
+    double u = (double)(h >> 11) / (double)(1ULL << 53);
+
+    return (size_t)(min_size * pow((double)max_size / min_size, u));
+}
+
+/*
+ * build_zipf - cumulative distribution of object popularity
+ */
+static void build_zipf(void) {
+    double sum = 0;
+    long i;
+
+    zipf_cdf = malloc(sizeof(double) * nobjects);
+    if (zipf_cdf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < nobjects; i++) {
+        sum += 1.0 / pow((double)(i + 1), skew);
+        zipf_cdf[i] = sum;
+    }
+    for (i = 0; i < nobjects; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+/*
+ * pick_object - draw an object id
+ */
+static long pick_object(uint64_t *rng) {
+    double u = next_random(rng);
+    long lo = 0, hi = nobjects - 1;
+
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * start_request - open a connection to the proxy for the next object
+ */
+static void start_request(worker_t *w, int epfd, conn_t *c) {
+    struct epoll_event ev;
+    long id = pick_object(&w->rng);
+
+    c->expected = object_size(id);
+    if (fixed_path != NULL) {
+        c->request_len = snprintf(c->request, REQLEN,
+                                  "GET http://%s:%s%s HTTP/1.0\r\n"
+                                  "Host: %s:%s\r\n\r\n",
+                                  origin_host, origin_port, fixed_path,
+                                  origin_host, origin_port);
+    } else {
+        c->request_len = snprintf(c->request, REQLEN,
+                                  "GET http://%s:%s/obj/%ld-%zu HTTP/1.0\r\n"
+                                  "Host: %s:%s\r\n\r\n",
+                                  origin_host, origin_port, id, c->expected,
+                                  origin_host, origin_port);
+    }
+    c->sent = c->head_len = c->received = 0;
+    clock_gettime(CLOCK_MONOTONIC, &c->start);
+
+    c->fd = socket(proxy_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    c->phase = CONN_CONNECTING;
+    if (connect(c->fd, proxy_addr->ai_addr, proxy_addr->ai_addrlen) < 0 &&
+        errno != EINPROGRESS) {
+        c->phase = CONN_SENDING; /*reported by the first send*/
+    }
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+/*
+ * response_ok - check the status line and the body length of a response
+ */
+static bool response_ok(conn_t *c) {
+    char *end;
+
+    if (c->head_len < 12 || strncmp(c->head, "HTTP/1.", 7) != 0 ||
+        strncmp(c->head + 9, "200", 3) != 0) {
+        return false;
+    }
+    /*origins other than ours may send any headers and body*/
+    if (external_origin) {
+        return true;
+    }
+    end = memmem(c->head, c->head_len, "\r\n\r\n", 4);
+    return end != NULL &&
+           c->received == (size_t)(end + 4 - c->head) + c->expected;
+}
+
+/*
+ * finish_request - record a request and start the next one
+ */
+static void finish_request(worker_t *w, int epfd, conn_t *c, bool ok) {
+    uint64_t us = elapsed_us(&c->start);
+
+    close(c->fd);
+    c->fd = -1;
+    if (measuring) {
+        if (ok) {
+            w->stats.requests++;
+            w->stats.bytes += c->received;
+            w->stats.hist[bucket_of(us)]++;
+            if (us > w->stats.max_us) {
+                w->stats.max_us = us;
+            }
+        } else {
+            w->stats.errors++;
+        }
+    }
+    if (!stopping) {
+        start_request(w, epfd, c);
+    }
+}
+
+/*
+ * handle_event - advance a connection that epoll reported ready
+ */
+static void handle_event(worker_t *w, int epfd, conn_t *c) {
+    static __thread char buf[READLEN];
+    struct epoll_event ev;
+    ssize_t n;
+    int err;
+    socklen_t len = sizeof(err);
+
+    if (c->phase == CONN_CONNECTING) {
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+            err != 0) {
+            finish_request(w, epfd, c, false);
+            return;
+        }
+        c->phase = CONN_SENDING;
+    }
+    if (c->phase == CONN_SENDING) {
+        n = send(c->fd, c->request + c->sent, c->request_len - c->sent,
+                 MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                finish_request(w, epfd, c, false);
+            }
+            return;
+        }
+        c->sent += n;
+        if (c->sent < c->request_len) {
+            return;
+        }
+        c->phase = CONN_READING;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        return;
+    }
+
+    while ((n = read(c->fd, buf, READLEN)) > 0) {
+        if (c->head_len < HEADLEN) {
+            size_t keep = HEADLEN - c->head_len < (size_t)n
+                              ? HEADLEN - c->head_len
+                              : (size_t)n;
+            memcpy(c->head + c->head_len, buf, keep);
+            c->head_len += keep;
+        }
+        c->received += n;
+    }
+    if (n == 0) {
+        finish_request(w, epfd, c, response_ok(c));
+    } else if (errno != EAGAIN) {
+        finish_request(w, epfd, c, false);
+    }
+}
+
+/*
+ * worker - run a share of the connections until the run stops
+ */
+static void *worker(void *vargp) {
+    worker_t *w = vargp;
+    struct epoll_event events[64];
+    int epfd, i, n;
+
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    for (i = 0; i < w->count; i++) {
+        start_request(w, epfd, &conns[w->first + i]);
+    }
+    while (!stopping) {
+        n = epoll_wait(epfd, events, 64, 100);
+        for (i = 0; i < n; i++) {
+            handle_event(w, epfd, events[i].data.ptr);
+        }
+    }
+    for (i = 0; i < w->count; i++) {
+        if (conns[w->first + i].fd >= 0) {
+            close(conns[w->first + i].fd);
+        }
+    }
+    close(epfd);
+    return NULL;
+}
+
+/*
+ * responder - serve /obj/<id>-<size> requests with <size> bytes
+ */
+static void *responder(void *vargp) {
+    int listenfd = *(int *)vargp;
+    char req[2048], hdr[256];
+    size_t got;
+    ssize_t n;
+    long id;
+    size_t size;
+    int connfd, hlen;
+
+    while (1) {
+        connfd = accept(listenfd, NULL, NULL);
+        if (connfd < 0) {
+            continue;
+        }
+        got = 0;
+        req[0] = '\0';
+        while (strstr(req, "\r\n\r\n") == NULL && got < sizeof(req) - 1 &&
+               (n = read(connfd, req + got, sizeof(req) - 1 - got)) > 0) {
+            got += n;
+            req[got] = '\0';
+        }
+        __atomic_fetch_add(&origin_requests, 1, __ATOMIC_RELAXED);
+        if (sscanf(req, "GET /obj/%ld-%zu", &id, &size) != 2 ||
+            size > MAX_BODY) {
+            hlen = snprintf(hdr, sizeof(hdr),
+                            "HTTP/1.0 404 Not Found\r\n"
+                            "Content-Length: 0\r\n\r\n");
+            size = 0;
+        } else {
+            hlen = snprintf(hdr, sizeof(hdr),
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: application/octet-stream\r\n"
+                            "Content-Length: %zu\r\n\r\n",
+                            size);
+        }
+        if (send(connfd, hdr, hlen, MSG_NOSIGNAL) == hlen) {
+            for (got = 0; got < size; got += n) {
+                n = send(connfd, body + got, size - got, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    break;
+                }
+            }
+        }
+        close(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * start_responder - listen on the origin port and start the responders
+ */
+static void start_responder(void) {
+    static int listenfd;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t tid;
+    int i, optval = 1;
+
+    for (i = 0; i < MAX_BODY; i++) {
+        body[i] = 'a' + i % 26;
+    }
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(origin_port));
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenfd, 1024) < 0) {
+        perror("origin bind");
+        exit(1);
+    }
+    getsockname(listenfd, (struct sockaddr *)&addr, &len);
+    snprintf(origin_port, sizeof(origin_port), "%d", ntohs(addr.sin_port));
+    for (i = 0; i < RESPONDERS; i++) {
+        pthread_create(&tid, NULL, responder, &listenfd);
+        pthread_detach(tid);
+    }
+}
+
+/*
+ * split_hostport - split host:port, -1 if there is no colon
+ */
+static int split_hostport(const char *arg, char *host, size_t hostlen,
+                          char *port, size_t portlen) {
+    const char *colon = strrchr(arg, ':');
+
+    if (colon == NULL || (size_t)(colon - arg) >= hostlen ||
+        strlen(colon + 1) >= portlen) {
+        return -1;
+    }
+    memcpy(host, arg, colon - arg);
+    host[colon - arg] = '\0';
+    strcpy(port, colon + 1);
+    return 0;
+}
+
+/*
+ * report - merge the worker statistics and print them
+ */
+static void report(double seconds, uint64_t origin) {
+    static stats_t total;
+    static const double marks[] = {50, 90, 99, 99.9};
+    uint64_t seen = 0;
+    int i, b, m = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        for (b = 0; b < BUCKETS; b++) {
+            total.hist[b] += workers[i].stats.hist[b];
+        }
+        total.requests += workers[i].stats.requests;
+        total.errors += workers[i].stats.errors;
+        total.bytes += workers[i].stats.bytes;
+        if (workers[i].stats.max_us > total.max_us) {
+            total.max_us = workers[i].stats.max_us;
+        }
+    }
+
+    printf("connections %d, threads %d, %ld objects, skew %.2f, "
+           "sizes %zu..%zu\n",
+           nconns, nthreads, nobjects, skew, min_size, max_size);
+    printf("requests    %lu in %.1fs, %.0f req/s, %.1f MB/s\n",
+           (unsigned long)total.requests, seconds, total.requests / seconds,
+           total.bytes / seconds / 1e6);
+    printf("errors      %lu\n", (unsigned long)total.errors);
+    printf("latency us ");
+    for (b = 0; b < BUCKETS && m < 4 && total.requests > 0; b++) {
+        seen += total.hist[b];
+        while (m < 4 && seen >= total.requests * marks[m] / 100) {
+            printf(" p%g %lu", marks[m], (unsigned long)bucket_value(b));
+            m++;
+        }
+    }
+    printf(" max %lu\n", (unsigned long)total.max_us);
+    if (external_origin || total.requests == 0) {
+        printf("hit ratio   n/a\n");
+    } else {
+        double ratio = 1.0 - (double)origin / total.requests;
+        printf("hit ratio   %.3f (%lu origin fetches)\n",
+               ratio < 0 ? 0 : ratio, (unsigned long)origin);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s -x proxyhost:port [-e originhost:port] [-o originport]"
+            "\n       [-c conns] [-t threads] [-d seconds] [-w seconds]"
+            "\n       [-n objects] [-z skew] [-s min:max] [-u path]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct addrinfo hints;
+    struct timespec begin;
+    uint64_t origin_start, origin_end, us;
+    int c, i, rc;
+
+    proxy_host[0] = '\0';
+    while ((c = getopt(argc, argv, "x:e:o:c:t:d:w:n:z:s:u:")) != -1) {
+        switch (c) {
+        case 'x':
+            if (split_hostport(optarg, proxy_host, sizeof(proxy_host),
+                               proxy_port, sizeof(proxy_port)) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'e':
+            if (split_hostport(optarg, origin_host, sizeof(origin_host),
+                               origin_port, sizeof(origin_port)) < 0) {
+                usage(argv[0]);
+            }
+            external_origin = true;
+            break;
+        case 'o':
+            snprintf(origin_port, sizeof(origin_port), "%s", optarg);
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'n':
+            nobjects = atol(optarg);
+            break;
+        case 'z':
+            skew = atof(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%zu:%zu", &min_size, &max_size) != 2) {
+                usage(argv[0]);
+            }
+            break;
+        case 'u':
+            fixed_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (proxy_host[0] == '\0' || (fixed_path != NULL && !external_origin) || nconns < 1 || nthreads < 1 ||
+        nthreads > MAX_THREADS || duration < 1 || warmup < 0 ||
+        nobjects < 1 || skew < 0 || min_size < 1 || max_size < min_size ||
+        max_size > MAX_BODY) {
+        usage(argv[0]);
+    }
+    if (nthreads > nconns) {
+        nthreads = nconns;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo(proxy_host, proxy_port, &hints, &proxy_addr)) != 0) {
+        fprintf(stderr, "getaddrinfo %s: %s\n", proxy_host, gai_strerror(rc));
+        exit(1);
+    }
+    if (!external_origin) {
+        start_responder();
+    }
+    build_zipf();
+
+    conns = calloc(nconns, sizeof(conn_t));
+    if (conns == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < nthreads; i++) {
+        workers[i].first = nconns * i / nthreads;
+        workers[i].count = nconns * (i + 1) / nthreads - workers[i].first;
+        workers[i].rng = 0x2545F4914F6CDD1DULL * (i + 1);
+        pthread_create(&workers[i].tid, NULL, worker, &workers[i]);
+    }
+
+    sleep(warmup);
+    origin_start = __atomic_load_n(&origin_requests, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    measuring = 1;
+    sleep(duration);
+    measuring = 0;
+    us = elapsed_us(&begin);
+    origin_end = __atomic_load_n(&origin_requests, __ATOMIC_RELAXED);
+    stopping = 1;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    report(us / 1e6, origin_end - origin_start);
+    return 0;
+}
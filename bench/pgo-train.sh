@@ -0,0 +1,22 @@
+#!/usr/bin/env bash
+#
+# pgo-train.sh - exercise an instrumented proxy to collect its profile
+#
+# usage: bench/pgo-train.sh <instrumented proxy>
+#
+# Replays the correctness tests and the P series, then a load benchmark.
+# Test failures do not matter here, only the code paths they execute.
+# Every proxy run writes its counts when it exits.
+
+proxy=$1
+dir=$(dirname "$0")
+
+if [ ! -x "${proxy}" ]; then
+  echo "usage: $0 <instrumented proxy>"
+  exit 1
+fi
+
+pxy/pxyregress.py -p "${proxy}" -s ABCDP -a 50 -t 120 | tail -3
+"${dir}/run-bench.sh" "${proxy}" -d 10 -w 1 -c 32
+"${dir}/run-bench.sh" "${proxy}" -d 5 -w 1 -c 16 -s 4096:262144 -z 0.8
+exit 0
@@ -0,0 +1,39 @@
+#!/usr/bin/env bash
+#
+# run-bench.sh - start a proxy, drive it with loadgen, and stop it
+#
+# usage: bench/run-bench.sh <proxy binary> [loadgen options]
+#
+# The proxy gets a free port of its own; loadgen runs its built-in origin
+# unless the options name an external one with -e.
+
+proxy=$1
+shift
+dir=$(dirname "$0")
+
+if [ ! -x "${proxy}" ] || [ ! -x "${dir}/loadgen" ]; then
+  echo "usage: $0 <proxy binary> [loadgen options]"
+  exit 1
+fi
+
+# Find a port nobody is listening on
+for attempt in $(seq 20); do
+  port=$(( (RANDOM % 20000) + 20000 ))
+  if ! (exec 3<>/dev/tcp/localhost/${port}) 2>/dev/null; then
+    break
+  fi
+done
+
+"${proxy}" ${PROXY_ARGS} ${port} > /dev/null 2>&1 &
+pid=$!
+trap 'kill ${pid} 2>/dev/null' EXIT
+
+# Wait for the proxy to accept connections
+for attempt in $(seq 50); do
+  if (exec 3<>/dev/tcp/localhost/${port}) 2>/dev/null; then
+    break
+  fi
+  sleep 0.1
+done
+
+"${dir}/loadgen" -x localhost:${port} "$@"
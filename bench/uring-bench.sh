@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+#
+# uring-bench.sh - compare the blocking thread-per-connection I/O with the
+#                  io_uring engine (proxy -U)
+#
+# usage: bench/uring-bench.sh [proxy [loadgen options]]
+#
+# Both runs use the same proxy binary and the same load; the change in
+# requests/s is relative to the blocking run.
+
+dir=$(dirname "$0")
+proxy=${1:-${dir}/../proxy}
+shift
+args=${*:--d 10 -w 2 -c 32}
+
+run() {
+  PROXY_ARGS="$1" "${dir}/run-bench.sh" "${proxy}" ${args}
+}
+
+printf "%-24s %12s %10s %10s\n" "engine" "requests/s" "p99 us" "change"
+reference=""
+for engine in blocking io_uring; do
+  if [ "${engine}" = io_uring ]; then
+    out=$(run "${PROXY_ARGS} -U")
+  else
+    out=$(run "${PROXY_ARGS}")
+  fi
+  rate=$(echo "${out}" | awk '/^requests/ {print $5}')
+  p99=$(echo "${out}" | awk '/^latency/ {for (i = 1; i < NF; i++) if ($i == "p99") print $(i + 1)}')
+  if [ -z "${reference}" ]; then
+    reference=${rate}
+    change="-"
+  else
+    change=$(awk -v r="${rate}" -v b="${reference}" \
+      'BEGIN {printf "%+.1f%%", 100 * (r - b) / b}')
+  fi
+  printf "%-24s %12s %10s %10s\n" "${engine}" "${rate}" "${p99}" "${change}"
+done
@@ -1,39 +1,200 @@
 /**
  * @file cache.c
- * @brief Doubly linked list cache using LRU evict policy
+ * @brief Doubly linked list cache using LRU or CLOCK evict policy
  * @author Junshang Jia <junshanj@andrew.cmu.edu>
  *
  */
 
 #include "cache.h"
+#include "probes.h"
+#include "rcu.h"
+
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+/*smallest hash index, and cache bytes per bucket above it*/
+#define MIN_BUCKETS 1024
+#define BUCKET_BYTES 4096
 
 static block_t *head = NULL;
+static block_t *tail = NULL;
+/*hash index, chains are published with release stores*/
+static block_t **buckets = NULL;
+static size_t bucket_mask = 0;
+/*advanced by every insert, read by lookups without the lock*/
 static int lru_counter = 0;
+static cache_policy_t cache_policy = CACHE_LRU;
+/*CLOCK hand, the next block to visit, NULL to start over at the tail*/
+static block_t *hand = NULL;
 static size_t cache_size = 0;
+static size_t cache_capacity = MAX_CACHE_SIZE;
+static evict_hook_t evict_hook = NULL;
+/*retired blocks not yet given to the evict hook they were retired with*/
+static int releasing = 0;
+
+/*
+ * pinned - a vary marker stays until its last variant is gone, so that the
+ * variants always count toward the marker they were inserted under
+ */
+static int pinned(block_t *block) {
+    return block->kind == BLOCK_VARY && block->variants > 0;
+}
+
+/*
+ * clock_sweep - advance the CLOCK hand to a block that was not referenced
+ */
+static block_t *clock_sweep(void) {
+    for (;;) {
+        if (hand == NULL) {
+            hand = tail;
+        }
+        if (pinned(hand)) {
+            hand = hand->prev;
+            continue;
+        }
+        if (!__atomic_load_n(&hand->referenced, __ATOMIC_RELAXED)) {
+            return hand;
+        }
+        /*second chance: clear the bit and move on*/
+        __atomic_store_n(&hand->referenced, 0, __ATOMIC_RELAXED);
+        hand = hand->prev;
+    }
+}
 
 /**
- * The function searches for the evict block with the minimum LRU count in a
- * linked list and returns it.
+ * The function searches for the block to evict. Under LRU it is the block
+ * with the minimum LRU count in the linked list. Under CLOCK the hand sweeps
+ * from older to newer blocks, wrapping to the tail, clearing reference bits
+ * until it reaches a block that has not been hit since its last visit.
+ * Vary markers with variants cached are skipped.
  *
  * @return a pointer to a block_t structure.
  */
 block_t *search_evict_block() {
-    block_t *min_lru_block = head;
+    if (cache_policy == CACHE_CLOCK) {
+        return clock_sweep();
+    }
+    block_t *min_lru_block = NULL;
+    int min_lru = INT_MAX;
     block_t *current;
-    /*find min lru block in the list*/
+    /*find min lru block in the list, the oldest insert on a tie*/
     for (current = head; current != NULL; current = current->next) {
-        if (current->lru_count < min_lru_block->lru_count) {
+        if (pinned(current)) {
+            continue;
+        }
+        int lru = __atomic_load_n(&current->lru_count, __ATOMIC_RELAXED);
+        if (lru <= min_lru) {
+            min_lru = lru;
             min_lru_block = current;
         }
     }
     return min_lru_block;
 }
 
+/*
+ * mix - fold the 128-bit product of two words into 64 bits
+ */
+static uint64_t mix(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+/*
+ * key_hash - 64-bit hash of a key, 16 bytes per multiply (wyhash style)
+ */
+static uint64_t key_hash(const char *key, size_t length) {
+    uint64_t hash = 0xa0761d6478bd642fULL ^ length;
+    uint64_t a, b;
+
+    while (length > 16) {
+        memcpy(&a, key, 8);
+        memcpy(&b, key + 8, 8);
+        hash = mix(a ^ 0xe7037ed1a0b428dbULL, b ^ hash);
+        key += 16;
+        length -= 16;
+    }
+    /*the last 1 to 16 bytes, as two possibly overlapping words*/
+    a = 0;
+    b = 0;
+    if (length >= 8) {
+        memcpy(&a, key, 8);
+        memcpy(&b, key + length - 8, 8);
+    } else {
+        memcpy(&a, key, length);
+    }
+    hash = mix(a ^ 0xe7037ed1a0b428dbULL, b ^ hash);
+    return mix(hash ^ 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL);
+}
+
+/*
+ * index_find - look a key up in the hash index, without the lock
+ *
+ * Chains are compared by the full 64-bit hash first; the key itself is
+ * only read when the hashes match.
+ */
+static block_t *index_find(const char *key, size_t length, uint64_t hash) {
+    block_t **table = __atomic_load_n(&buckets, __ATOMIC_ACQUIRE);
+    block_t *current;
+
+    if (table == NULL) {
+        return NULL;
+    }
+    current = __atomic_load_n(&table[hash & bucket_mask], __ATOMIC_ACQUIRE);
+    while (current != NULL) {
+        if (current->hash == hash && current->key_length == length &&
+            memcmp(current->key, key, length) == 0) {
+            return current;
+        }
+        current = __atomic_load_n(&current->hnext, __ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
+
+/*
+ * index_lookup - hash a key and find it in the index
+ */
+static block_t *index_lookup(const char *key) {
+    size_t length = strnlen(key, MAXLINE - 1);
+    return index_find(key, length, key_hash(key, length));
+}
+
+/*
+ * variant_marker - the vary marker of a variant's uri, if it is cached
+ */
+static block_t *variant_marker(block_t *variant) {
+    const char *separator = memchr(variant->key, '\n', variant->key_length);
+    size_t length;
+    block_t *vary;
+
+    if (separator == NULL) {
+        return NULL;
+    }
+    length = separator - variant->key;
+    vary = index_find(variant->key, length, key_hash(variant->key, length));
+    return vary != NULL && vary->kind == BLOCK_VARY ? vary : NULL;
+}
+
+/*
+ * index_unlink - take a block out of its hash chain, under the lock
+ *
+ * The block's own hnext is left alone: a lookup standing on it can still
+ * walk the rest of the chain.
+ */
+static void index_unlink(block_t *block) {
+    block_t **link = &buckets[block->hash & bucket_mask];
+
+    while (*link != block) {
+        link = &(*link)->hnext;
+    }
+    __atomic_store_n(link, block->hnext, __ATOMIC_RELEASE);
+}
+
 /**
- * The function initializes a block with a given key, value, length, and update
- * LRU count.
+ * The function allocates a block and copies a key and web object into it. It
+ * touches no cache state, so it is called before taking the cache lock.
  *
  * @param key The "key" parameter is a character array that represents the key
  * associated with the block. It has a maximum length of MAXLINE.
@@ -46,104 +207,181 @@ block_t *search_evict_block() {
  *
  * @return a pointer to a block_t structure.
  */
-block_t *block_init(char key[MAXLINE], char value[MAX_OBJECT_SIZE],
+block_t *block_init(char key[MAXLINE], const char *value,
                     size_t length) {
-    /*initalize the block*/
-    block_t *block = malloc(sizeof(block_t));
-    memcpy(block->key, key, MAXLINE);
-    memcpy(block->value, value, MAX_OBJECT_SIZE);
-    /*update the lru data*/
-    lru_counter++;
-    block->lru_count = lru_counter;
+    /*initalize the block, sized to the web object and the key after it*/
+    size_t key_length = strnlen(key, MAXLINE - 1);
+    block_t *block = malloc(sizeof(block_t) + length + key_length + 1);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->key = block->value + length;
+    memcpy(block->key, key, key_length);
+    block->key[key_length] = '\0';
+    block->key_length = key_length;
+    block->hash = key_hash(key, key_length);
+    memcpy(block->value, value, length);
+    /*the lru data is set when the block is published*/
+    block->lru_count = 0;
+    block->referenced = 0;
+    block->kind = BLOCK_OBJECT;
+    block->variants = 0;
     block->value_length = length;
     block->next = NULL;
     block->prev = NULL;
+    block->hnext = NULL;
     return block;
 }
 /**
- * The function removes a block from a linked list and updates the cache size.
+ * The function removes a block from a linked list and the hash index and
+ * updates the cache size. The block is not freed, lookups may still be
+ * reading it.
  *
  * @param block The `block` parameter is a pointer to a `block_t` structure.
  *
  */
 void remove_block(block_t *block) {
-    /*length of the web object*/
-    size_t length = block->value_length;
-
     block_t *prev = block->prev;
     block_t *next = block->next;
-    /*free the block and handle each case*/
-    if (prev == NULL && next == NULL) {
-        head = NULL;
-        free(block);
-    } else if (prev != NULL && next == NULL) {
-        prev->next = NULL;
-        free(block);
-    } else if (prev == NULL && next != NULL) {
-        head = next;
-        next->prev = NULL;
 
-        free(block);
+    index_unlink(block);
+    if (block->kind == BLOCK_VARIANT) {
+        block_t *vary = variant_marker(block);
+        if (vary != NULL) {
+            vary->variants--;
+        }
+    }
+    if (hand == block) {
+        hand = prev;
+    }
+    if (prev == NULL) {
+        head = next;
     } else {
         prev->next = next;
+    }
+    if (next != NULL) {
         next->prev = prev;
-        block->prev = NULL;
-        block->next = NULL;
-        free(block);
+    } else {
+        tail = prev;
     }
-    cache_size -= length;
-
-    return;
+    block->prev = NULL;
+    block->next = NULL;
+    cache_size -= block->value_length;
 }
 
 /**
- * The function `add_block` adds a new block to a cache, ensuring that the cache
- * does not exceed its maximum size.
- *
- * @param key A character array representing the key of the block to be added to
- * the cache. The key is used to identify the block. use uri as the key
- * @param value The `value` parameter in the `add_block` function is a character
- * array that represents the value associated with the given `key`. It has a
- * maximum size of `MAX_OBJECT_SIZE`.
- * @param length The `length` parameter represents the length of the valid web
- * object to be stored in the cache block.
- *
- * @return The function does not explicitly return a value.
- */
-void add_block(char key[MAXLINE], char value[MAX_OBJECT_SIZE], size_t length) {
-    /*check if the block is exist in the cache*/
-    block_t *check = chceck_cache_repeat(key);
-    /*if the block exsit in the cache, resturn*/
-    if (check != NULL) {
+ * The function publishes a block built by block_init() at the head of the
+ * cache, unlinking blocks until it fits. Nothing is copied or freed, the
+ * caller holds the cache lock and passes the result to cache_release() once
+ * it has dropped it. A variant is only inserted while its URI's vary marker
+ * is cached with fewer than MAX_VARIANTS variants, and a marker is not
+ * evicted while it has any.
+ *
+ * @param block The new block.
+ * @param retired Receives the evicted blocks, and the new block itself if
+ * its key is already cached or it can never fit.
+ */
+void cache_insert(block_t *block, retired_t *retired) {
+    retired->evicted = NULL;
+    retired->rejected = NULL;
+    retired->hook = evict_hook;
+
+    /*if the block exsit in the cache, or never fits, hand it back*/
+    if (index_find(block->key, block->key_length, block->hash) != NULL ||
+        block->value_length > cache_capacity) {
+        retired->rejected = block;
         return;
     }
-    /*remove block until it below the MAX_CACHE_SIZE*/
-    while (cache_size + length > MAX_CACHE_SIZE) {
-
+    /*
+     * A variant needs its vary marker, with room for one more, and must fit
+     * beside it: the marker cannot be evicted once the variant counts.
+     */
+    if (block->kind == BLOCK_VARIANT) {
+        block_t *vary = variant_marker(block);
+        if (vary == NULL || vary->variants >= MAX_VARIANTS ||
+            vary->value_length + block->value_length > cache_capacity) {
+            retired->rejected = block;
+            return;
+        }
+        vary->variants++;
+    }
+    /*remove block until it below the capacity*/
+    while (cache_size + block->value_length > cache_capacity) {
         block_t *evict = search_evict_block();
 
-        if (evict != NULL) {
-            remove_block(evict);
-        } else {
-            sio_printf("evict_error\n");
-        }
+        PROBE2(cache__evict, evict->key, evict->value_length);
+        remove_block(evict);
+        evict->next = retired->evicted;
+        retired->evicted = evict;
+    }
+    /*counted until cache_release() has given them to the hook*/
+    if (retired->evicted != NULL && retired->hook != NULL) {
+        __atomic_add_fetch(&releasing, 1, __ATOMIC_RELAXED);
     }
 
-    block_t *block = block_init(key, value, length);
+    int lru = lru_counter + 1;
+    __atomic_store_n(&lru_counter, lru, __ATOMIC_RELAXED);
+    block->lru_count = lru;
+    PROBE2(cache__insert, block->key, block->value_length);
 
     /*add block on head*/
-    if (head == NULL) {
-        head = block;
-
-    } else {
-        /*add block in the middle or end of the list*/
-        block->next = head;
+    block->prev = NULL;
+    block->next = head;
+    if (head != NULL) {
         head->prev = block;
-        head = block;
+    } else {
+        tail = block;
     }
+    head = block;
+    /*publish it to lookups once it is complete*/
+    block_t **bucket = &buckets[block->hash & bucket_mask];
+    block->hnext = *bucket;
+    __atomic_store_n(bucket, block, __ATOMIC_RELEASE);
     /*add total cache size*/
-    cache_size += length;
-    return;
+    cache_size += block->value_length;
+    /*counted before evicting: the marker is pinned from the first variant*/
+}
+
+/**
+ * The function gives evicted web objects to the evict hook and frees
+ * everything cache_insert() retired, waiting for lookups that may still be
+ * reading the evicted blocks. It is called without the cache lock.
+ *
+ * @param retired The blocks retired by cache_insert().
+ */
+void cache_release(retired_t *retired) {
+    block_t *block = retired->evicted;
+
+    /*the rejected block was never published, evicted ones may be in use*/
+    if (block != NULL) {
+        rcu_synchronize();
+    }
+    while (block != NULL) {
+        block_t *next = block->next;
+        /*give the web object to the next tier before dropping it*/
+        if (retired->hook != NULL && block->kind == BLOCK_OBJECT) {
+            retired->hook(block->key, block->value, block->value_length);
+        }
+        free(block);
+        block = next;
+    }
+    if (retired->evicted != NULL && retired->hook != NULL) {
+        __atomic_sub_fetch(&releasing, 1, __ATOMIC_RELEASE);
+    }
+    free(retired->rejected);
+}
+
+/**
+ * The function waits until every block evicted while an evict hook was set
+ * has been given to it. Called after removing the hook, it guarantees the
+ * hook is not running and will not run again.
+ */
+void cache_wait_released(void) {
+    struct timespec pause = {0, 1000000};
+
+    while (__atomic_load_n(&releasing, __ATOMIC_ACQUIRE) > 0) {
+        nanosleep(&pause, NULL);
+    }
 }
 
 /**
@@ -156,20 +394,16 @@ void add_block(char key[MAXLINE], char value[MAX_OBJECT_SIZE], size_t length) {
  * @return a pointer to a block_t structure.
  */
 block_t *chceck_cache_repeat(char key[MAXLINE]) {
-    block_t *current;
-
-    for (current = head; current != NULL; current = current->next) {
-        if (!strcmp(current->key, key)) {
-
-            return current;
-        }
-    }
-    return NULL;
+    return index_lookup(key);
 }
 
 /**
  * The function searches for a cache block with a given key and updates its LRU
- * count if found.
+ * count, or sets its reference bit under CLOCK, if found. It takes no lock;
+ * the caller is inside rcu_read_lock(), or holds the cache lock. Recency is
+ * approximate: the LRU count only advances when a block is inserted, so a hit
+ * writes the block only if it has not been hit since the last insert, or
+ * since the hand last cleared its bit.
  *
  * @param key The key parameter is a character array (string) with a maximum
  * length of MAXLINE. It is used to search for a specific key in the cache.
@@ -177,28 +411,101 @@ block_t *chceck_cache_repeat(char key[MAXLINE]) {
  * @return a pointer to a block_t structure.
  */
 block_t *search_cache(char key[MAXLINE]) {
+    block_t *block = index_lookup(key);
 
-    block_t *current;
+    if (block != NULL && cache_policy == CACHE_CLOCK) {
+        /*only the first hit after a sweep writes the block*/
+        if (!__atomic_load_n(&block->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&block->referenced, 1, __ATOMIC_RELAXED);
+        }
+    } else if (block != NULL) {
+        /*found the block in the cache and update lru data in block*/
+        int lru = __atomic_load_n(&lru_counter, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&block->lru_count, __ATOMIC_RELAXED) != lru) {
+            __atomic_store_n(&block->lru_count, lru, __ATOMIC_RELAXED);
+        }
+    }
+    return block;
+}
 
+/**
+ * The function registers a hook that is called by cache_release(), after the
+ * cache lock is dropped, for every web object evicted to make room for a new
+ * one. Vary markers and variants are not given to it.
+ * Pass NULL to remove it, then call cache_wait_released().
+ *
+ * @param hook The function receiving the evicted key and web object.
+ */
+void cache_set_evict_hook(evict_hook_t hook) {
+    evict_hook = hook;
+}
+
+/**
+ * The function calls a visitor on every block in the cache, most recently
+ * added first. The caller must hold the cache lock.
+ *
+ * @param visit The function called for each block.
+ * @param arg An opaque argument passed through to visit.
+ */
+void cache_walk(void (*visit)(block_t *block, void *arg), void *arg) {
+    block_t *current;
     for (current = head; current != NULL; current = current->next) {
-        if (!strcmp(current->key, key)) {
-            /*found the block in the cache and update lru data in block*/
-            lru_counter++;
-            current->lru_count = lru_counter;
-            return current;
-        }
+        visit(current, arg);
+    }
+}
+
+/**
+ * The function selects the replacement policy, CACHE_LRU by default. It is
+ * called before the cache is used.
+ *
+ * @param policy The policy evicting blocks from now on.
+ */
+void cache_set_policy(cache_policy_t policy) {
+    cache_policy = policy;
+}
+
+/**
+ * The function sets how many bytes of web objects the cache may hold. Blocks
+ * are evicted by the next cache_insert() if the cache is over the new
+ * capacity. Called on an empty cache, before any lookup, it also sizes the
+ * hash index for the capacity.
+ *
+ * @param capacity The capacity in bytes, MAX_CACHE_SIZE by default.
+ */
+void cache_set_capacity(size_t capacity) {
+    size_t count = MIN_BUCKETS;
+
+    cache_capacity = capacity;
+    if (head != NULL) {
+        return;
+    }
+    while (count < capacity / BUCKET_BYTES) {
+        count *= 2;
+    }
+    if (count != bucket_mask + 1) {
+        Free(buckets);
+        buckets = Calloc(count, sizeof(block_t *));
+        bucket_mask = count - 1;
     }
-    return NULL;
 }
 
 /**
  * @brief cache_init function initializes the cache by setting the head pointer
- * to NULL, the lru_counter to 0, and the cache_size to 0.
+ * to NULL, the lru_counter to 0, and the cache_size to 0, and empties the
+ * hash index.
  */
 void cache_init(void) {
     head = NULL;
+    tail = NULL;
+    hand = NULL;
     lru_counter = 0;
     cache_size = 0;
+    if (buckets == NULL) {
+        buckets = Calloc(MIN_BUCKETS, sizeof(block_t *));
+        bucket_mask = MIN_BUCKETS - 1;
+    } else {
+        memset(buckets, 0, (bucket_mask + 1) * sizeof(block_t *));
+    }
 }
 
 /**
@@ -208,10 +515,14 @@ void cache_init(void) {
  */
 void cache_free(void) {
     /*clean cache list*/
-    block_t *current = NULL;
+    block_t *current = head;
     while (current != NULL) {
         block_t *next = current->next;
         free(current);
         current = next;
     }
+    cache_init();
+    Free(buckets);
+    buckets = NULL;
+    bucket_mask = 0;
 }
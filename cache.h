@@ -1,34 +1,77 @@
 /**
  * @file cache.h
  * @brief Definitions and interfaces for cache.c
+ *
+ * Lookups go through a hash index that is read without the cache lock:
+ * search_cache() runs inside rcu_read_lock(), and the block it returns stays
+ * valid until rcu_read_unlock(). Everything that changes the cache is done by
+ * cache_insert() under the cache lock, and evicted blocks are freed by
+ * cache_release() once no reader can see them.
  */
 
 #include "csapp.h"
+
+#include <stdint.h>
+
 #define MAX_CACHE_SIZE (1024 * 1024)
 #define MAX_OBJECT_SIZE (100 * 1024)
+/* Most variants of one URI cached at a time */
+#define MAX_VARIANTS 8
+
+/*what a block holds*/
+typedef enum {
+    BLOCK_OBJECT,  /*a web object, keyed by its uri*/
+    BLOCK_VARY,    /*a vary marker, the header names its variants vary on*/
+    BLOCK_VARIANT, /*one variant, keyed by uri, '\n' and the header values*/
+} block_kind_t;
 
 /*doubly linked-list block structure in the cache*/
 typedef struct Block {
-    int lru_count;               /*LRU count*/
-    char key[MAXLINE];           /*store the uri as the ky*/
-    char value[MAX_OBJECT_SIZE]; /*Web object*/
-    size_t value_length;         /*length of the web object*/
-    struct Block *prev;          /*previous pointer*/
-    struct Block *next;          /*next pointer*/
-
+    int lru_count;       /*LRU count*/
+    int referenced;      /*CLOCK reference bit, set by hits*/
+    block_kind_t kind;   /*object, vary marker or variant*/
+    int variants;        /*variants cached, for a vary marker*/
+    uint64_t hash;       /*hash of the key, compared before the key*/
+    char *key;           /*the uri, stored after the web object*/
+    size_t key_length;   /*length of the key*/
+    size_t value_length; /*length of the web object*/
+    struct Block *prev;  /*previous pointer*/
+    struct Block *next;  /*next pointer*/
+    struct Block *hnext; /*hash chain, read without the lock*/
+    char value[];        /*Web object, value_length bytes, then the key*/
 } block_t;
 
+/*replacement policies the cache can run*/
+typedef enum {
+    CACHE_LRU,   /*evict the block with the minimum LRU count*/
+    CACHE_CLOCK, /*evict the first unreferenced block under the hand*/
+} cache_policy_t;
+
+/*callback given each block's key and web object once it has been evicted*/
+typedef void (*evict_hook_t)(const char *key, const char *value,
+                             size_t length);
+
+/*blocks taken out of the cache by cache_insert(), released after unlocking*/
+typedef struct {
+    block_t *evicted;  /*evicted blocks, linked through next*/
+    block_t *rejected; /*the new block, if it was not inserted*/
+    evict_hook_t hook; /*evict hook set when they were evicted*/
+} retired_t;
+
 /**
- * The function searches for the evict block with the minimum LRU count in a
- * linked list and returns it.
+ * The function searches for the block to evict. Under LRU it is the block
+ * with the minimum LRU count in the linked list. Under CLOCK the hand sweeps
+ * from older to newer blocks, wrapping to the tail, clearing reference bits
+ * until it reaches a block that has not been hit since its last visit.
+ * Vary markers with variants cached are skipped.
  *
  * @return a pointer to a block_t structure.
  */
 block_t *search_evict_block();
 
 /**
- * The function initializes a block with a given key, value, length, and update
- * LRU count.
+ * The function allocates a block and copies a key and web object into it. It
+ * touches no cache state, so it is called before taking the cache lock.
  *
  * @param key The "key" parameter is a character array that represents the key
  * associated with the block. It has a maximum length of MAXLINE.
@@ -41,11 +84,13 @@ block_t *search_evict_block();
  *
  * @return a pointer to a block_t structure.
  */
-block_t *block_init(char key[MAXLINE], char value[MAX_OBJECT_SIZE],
+block_t *block_init(char key[MAXLINE], const char *value,
                     size_t length);
 
 /**
- * The function removes a block from a linked list and updates the cache size.
+ * The function removes a block from a linked list and the hash index and
+ * updates the cache size. The block is not freed, lookups may still be
+ * reading it.
  *
  * @param block The `block` parameter is a pointer to a `block_t` structure.
  *
@@ -53,20 +98,34 @@ block_t *block_init(char key[MAXLINE], char value[MAX_OBJECT_SIZE],
 void remove_block(block_t *block);
 
 /**
- * The function `add_block` adds a new block to a cache, ensuring that the cache
- * does not exceed its maximum size.
- *
- * @param key A character array representing the key of the block to be added to
- * the cache. The key is used to identify the block. use uri as the key
- * @param value The `value` parameter in the `add_block` function is a character
- * array that represents the value associated with the given `key`. It has a
- * maximum size of `MAX_OBJECT_SIZE`.
- * @param length The `length` parameter represents the length of the valid web
- * object to be stored in the cache block.
- *
- * @return The function does not explicitly return a value.
+ * The function publishes a block built by block_init() at the head of the
+ * cache, unlinking blocks until it fits. Nothing is copied or freed, the
+ * caller holds the cache lock and passes the result to cache_release() once
+ * it has dropped it. A variant is only inserted while its URI's vary marker
+ * is cached with fewer than MAX_VARIANTS variants, and a marker is not
+ * evicted while it has any.
+ *
+ * @param block The new block.
+ * @param retired Receives the evicted blocks, and the new block itself if
+ * its key is already cached or it can never fit.
+ */
+void cache_insert(block_t *block, retired_t *retired);
+
+/**
+ * The function gives evicted web objects to the evict hook and frees
+ * everything cache_insert() retired, waiting for lookups that may still be
+ * reading the evicted blocks. It is called without the cache lock.
+ *
+ * @param retired The blocks retired by cache_insert().
+ */
+void cache_release(retired_t *retired);
+
+/**
+ * The function waits until every block evicted while an evict hook was set
+ * has been given to it. Called after removing the hook, it guarantees the
+ * hook is not running and will not run again.
  */
-void add_block(char key[MAXLINE], char value[MAX_OBJECT_SIZE], size_t length);
+void cache_wait_released(void);
 
 /**
  * The function checks if a given key exists in a cache and returns the
@@ -81,7 +140,11 @@ block_t *chceck_cache_repeat(char key[MAXLINE]);
 
 /**
  * The function searches for a cache block with a given key and updates its LRU
- * count if found.
+ * count, or sets its reference bit under CLOCK, if found. It takes no lock;
+ * the caller is inside rcu_read_lock(), or holds the cache lock. Recency is
+ * approximate: the LRU count only advances when a block is inserted, so a hit
+ * writes the block only if it has not been hit since the last insert, or
+ * since the hand last cleared its bit.
  *
  * @param key The key parameter is a character array (string) with a maximum
  * length of MAXLINE. It is used to search for a specific key in the cache.
@@ -90,6 +153,43 @@ block_t *chceck_cache_repeat(char key[MAXLINE]);
  */
 block_t *search_cache(char key[MAXLINE]);
 
+/**
+ * The function registers a hook that is called by cache_release(), after the
+ * cache lock is dropped, for every web object evicted to make room for a new
+ * one. Vary markers and variants are not given to it.
+ * Pass NULL to remove it, then call cache_wait_released().
+ *
+ * @param hook The function receiving the evicted key and web object.
+ */
+void cache_set_evict_hook(evict_hook_t hook);
+
+/**
+ * The function calls a visitor on every block in the cache, most recently
+ * added first. The caller must hold the cache lock.
+ *
+ * @param visit The function called for each block.
+ * @param arg An opaque argument passed through to visit.
+ */
+void cache_walk(void (*visit)(block_t *block, void *arg), void *arg);
+
+/**
+ * The function selects the replacement policy, CACHE_LRU by default. It is
+ * called before the cache is used.
+ *
+ * @param policy The policy evicting blocks from now on.
+ */
+void cache_set_policy(cache_policy_t policy);
+
+/**
+ * The function sets how many bytes of web objects the cache may hold. Blocks
+ * are evicted by the next cache_insert() if the cache is over the new
+ * capacity. Called on an empty cache, before any lookup, it also sizes the
+ * hash index for the capacity.
+ *
+ * @param capacity The capacity in bytes, MAX_CACHE_SIZE by default.
+ */
+void cache_set_capacity(size_t capacity);
+
 /**
  * @brief cache_init function initializes the cache by setting the head pointer
  * to NULL, the lru_counter to 0, and the cache_size to 0.
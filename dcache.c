@@ -0,0 +1,492 @@
+/**
+ * @file dcache.c
+ * @brief Log-structured disk tier for objects evicted from the memory cache
+ *
+ * Evicted objects are appended to the active segment file as a record_t
+ * header followed by the key and the object bytes. An in-memory hash index
+ * maps each key to the segment and offset of its newest record. When the
+ * segment files outgrow the budget, the segment with the most dead bytes is
+ * compacted by copying its live records forward, or the oldest segment is
+ * dropped if no segment is worth compacting.
+ *
+ * Segments are reference counted so sendfile() can run without holding the
+ * disk cache lock; a retired segment is unlinked immediately and its file
+ * descriptor is closed once the last sender releases it.
+ */
+
+#include "dcache.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DCACHE_BUCKETS 4096
+#define RECORD_MAGIC 0x44595850 /* "PXYD" */
+#define PATHLEN (MAXLINE + 32)
+
+/*on-disk record header, followed by the key and the web object*/
+typedef struct {
+    uint32_t magic;        /*RECORD_MAGIC*/
+    uint32_t key_length;   /*length of the key, no terminator*/
+    uint64_t value_length; /*length of the web object*/
+} record_t;
+
+/*one segment file, kept in a list from oldest to newest*/
+typedef struct Segment {
+    unsigned id;          /*number in the file name*/
+    int fd;               /*open file descriptor*/
+    size_t tail;          /*bytes written so far*/
+    size_t live;          /*bytes of records still in the index*/
+    int refcount;         /*index users plus in-flight senders*/
+    struct Segment *next; /*next newer segment*/
+} segment_t;
+
+/*index entry for the newest record of a key*/
+typedef struct Dentry {
+    char *key;           /*uri*/
+    segment_t *segment;  /*segment holding the record*/
+    off_t offset;        /*offset of the web object in the segment*/
+    size_t length;       /*length of the web object*/
+    int hits;            /*disk hits since the object was spilled*/
+    struct Dentry *next; /*hash chain*/
+} dentry_t;
+
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static dentry_t *buckets[DCACHE_BUCKETS];
+static segment_t *oldest = NULL;
+static segment_t *active = NULL;
+static char seg_dir[MAXLINE];
+static size_t disk_budget = 0;
+static size_t segment_size = 0;
+static size_t disk_size = 0;
+static unsigned next_id = 0;
+static bool enabled = false;
+
+/*
+ * hash - djb2 string hash used to pick an index bucket
+ */
+static unsigned hash(const char *key) {
+    unsigned h = 5381;
+    while (*key != '\0') {
+        h = h * 33 + (unsigned char)*key++;
+    }
+    return h % DCACHE_BUCKETS;
+}
+
+/*
+ * record_size - bytes a record occupies in a segment file
+ */
+static size_t record_size(size_t key_length, size_t value_length) {
+    return sizeof(record_t) + key_length + value_length;
+}
+
+/*
+ * segment_path - build the file name of a segment
+ */
+static void segment_path(char *path, unsigned id) {
+    snprintf(path, PATHLEN, "%s/seg-%06u.log", seg_dir, id);
+}
+
+/*
+ * segment_open - create a new empty segment and append it to the list
+ */
+static segment_t *segment_open(void) {
+    char path[PATHLEN];
+    segment_t *seg = malloc(sizeof(segment_t));
+    if (seg == NULL) {
+        return NULL;
+    }
+    seg->id = next_id++;
+    segment_path(path, seg->id);
+    seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (seg->fd < 0) {
+        fprintf(stderr, "dcache: open %s failed: %s\n", path,
+                strerror(errno));
+        free(seg);
+        return NULL;
+    }
+    seg->tail = 0;
+    seg->live = 0;
+    seg->refcount = 1; /*reference held by the segment list*/
+    seg->next = NULL;
+    if (active != NULL) {
+        active->next = seg;
+    } else {
+        oldest = seg;
+    }
+    active = seg;
+    return seg;
+}
+
+/*
+ * segment_release - drop one reference, closing the file on the last one
+ */
+static void segment_release(segment_t *seg) {
+    if (--seg->refcount == 0) {
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+/*
+ * segment_retire - unlink a segment and remove it from the list
+ */
+static void segment_retire(segment_t *seg) {
+    char path[PATHLEN];
+    segment_t **link = &oldest;
+
+    while (*link != seg) {
+        link = &(*link)->next;
+    }
+    *link = seg->next;
+    if (active == seg) {
+        active = NULL;
+    }
+    segment_path(path, seg->id);
+    unlink(path);
+    disk_size -= seg->tail;
+    segment_release(seg);
+}
+
+/*
+ * index_find - look up the index entry of a key
+ */
+static dentry_t **index_find(const char *key) {
+    dentry_t **link = &buckets[hash(key)];
+    while (*link != NULL && strcmp((*link)->key, key) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/*
+ * index_unlink - remove an entry from its chain and mark its bytes dead
+ */
+static void index_unlink(dentry_t **link) {
+    dentry_t *entry = *link;
+    *link = entry->next;
+    entry->segment->live -= record_size(strlen(entry->key), entry->length);
+    free(entry->key);
+    free(entry);
+}
+
+/*
+ * append_record - write a record at the tail of the active segment
+ *
+ * Returns the offset of the web object, or -1 on error. Rolls over to a new
+ * segment when the active one is full.
+ */
+static off_t append_record(const char *key, const char *value,
+                           size_t length) {
+    record_t header;
+    size_t key_length = strlen(key);
+    size_t size = record_size(key_length, length);
+
+    if (active == NULL ||
+        (active->tail > 0 && active->tail + size > segment_size)) {
+        if (segment_open() == NULL) {
+            return -1;
+        }
+    }
+
+    header.magic = RECORD_MAGIC;
+    header.key_length = key_length;
+    header.value_length = length;
+
+    off_t offset = active->tail;
+    if (pwrite(active->fd, &header, sizeof(header), offset) !=
+            (ssize_t)sizeof(header) ||
+        pwrite(active->fd, key, key_length, offset + sizeof(header)) !=
+            (ssize_t)key_length ||
+        pwrite(active->fd, value, length,
+               offset + sizeof(header) + key_length) != (ssize_t)length) {
+        fprintf(stderr, "dcache: write failed: %s\n", strerror(errno));
+        return -1;
+    }
+    active->tail += size;
+    active->live += size;
+    disk_size += size;
+    return offset + sizeof(header) + key_length;
+}
+
+/*
+ * compact_segment - copy the live records of a segment forward and retire it
+ */
+static void compact_segment(segment_t *seg) {
+    int i;
+    char *buf = malloc(segment_size);
+
+    for (i = 0; i < DCACHE_BUCKETS; i++) {
+        dentry_t **link = &buckets[i];
+        while (*link != NULL) {
+            dentry_t *entry = *link;
+            if (entry->segment != seg) {
+                link = &entry->next;
+                continue;
+            }
+            off_t offset = -1;
+            if (buf != NULL &&
+                pread(seg->fd, buf, entry->length, entry->offset) ==
+                    (ssize_t)entry->length) {
+                offset = append_record(entry->key, buf, entry->length);
+            }
+            /*records that cannot be copied are dropped with the segment*/
+            if (offset < 0) {
+                index_unlink(link);
+                continue;
+            }
+            seg->live -= record_size(strlen(entry->key), entry->length);
+            entry->segment = active;
+            entry->offset = offset;
+            link = &entry->next;
+        }
+    }
+    free(buf);
+    segment_retire(seg);
+}
+
+/*
+ * drop_segment - forget every record of a segment and retire it
+ */
+static void drop_segment(segment_t *seg) {
+    int i;
+    for (i = 0; i < DCACHE_BUCKETS; i++) {
+        dentry_t **link = &buckets[i];
+        while (*link != NULL) {
+            if ((*link)->segment == seg) {
+                index_unlink(link);
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+    segment_retire(seg);
+}
+
+/*
+ * reclaim - make room for size more bytes within the disk budget
+ *
+ * Compacts the sealed segment with the fewest live bytes while at least half
+ * of it is dead; otherwise drops the oldest segment.
+ */
+static void reclaim(size_t size) {
+    while (disk_size + size > disk_budget && oldest != NULL &&
+           oldest != active) {
+        segment_t *seg, *victim = NULL;
+        for (seg = oldest; seg != active; seg = seg->next) {
+            if (victim == NULL || seg->live < victim->live) {
+                victim = seg;
+            }
+        }
+        if (victim->live <= victim->tail / 2) {
+            compact_segment(victim);
+        } else {
+            drop_segment(oldest);
+        }
+    }
+}
+
+/**
+ * The function prepares the disk cache directory, removes stale segment files
+ * and opens the first segment.
+ *
+ * @param dir The directory holding the segment files. It is created if it
+ * does not exist.
+ * @param budget The maximum number of bytes the segment files may occupy.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int dcache_init(const char *dir, size_t budget) {
+    char path[PATHLEN];
+    unsigned id;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "dcache: mkdir %s failed: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    snprintf(seg_dir, sizeof(seg_dir), "%s", dir);
+
+    /*segments from a previous run are not indexed, remove them*/
+    for (id = 0;; id++) {
+        segment_path(path, id);
+        if (unlink(path) < 0) {
+            break;
+        }
+    }
+
+    disk_budget = budget;
+    segment_size = budget / 4;
+    if (segment_size > DCACHE_SEGMENT_SIZE) {
+        segment_size = DCACHE_SEGMENT_SIZE;
+    }
+    disk_size = 0;
+    next_id = 0;
+    if (segment_open() == NULL) {
+        return -1;
+    }
+    enabled = true;
+    return 0;
+}
+
+/**
+ * The function reports whether dcache_init() has been called successfully.
+ *
+ * @return true if the disk tier is enabled.
+ */
+bool dcache_enabled(void) {
+    return enabled;
+}
+
+/**
+ * The function appends an object to the active segment and indexes it. It has
+ * the signature of a cache eviction hook so it can be given to
+ * cache_set_evict_hook() directly.
+ *
+ * @param key The uri used as the cache key.
+ * @param value The web object.
+ * @param length The length of the web object.
+ */
+void dcache_put(const char *key, const char *value, size_t length) {
+    size_t size = record_size(strlen(key), length);
+
+    if (!enabled || size > segment_size) {
+        return;
+    }
+    pthread_mutex_lock(&dcache_lock);
+
+    reclaim(size);
+    dentry_t **link = index_find(key);
+    if (*link != NULL) {
+        index_unlink(link);
+    }
+    off_t offset = append_record(key, value, length);
+    if (offset >= 0) {
+        dentry_t *entry = malloc(sizeof(dentry_t));
+        char *copy = strdup(key);
+        /*out of memory: leave the record unindexed, its bytes dead*/
+        if (entry == NULL || copy == NULL) {
+            free(entry);
+            free(copy);
+            active->live -= size;
+            pthread_mutex_unlock(&dcache_lock);
+            return;
+        }
+        entry->key = copy;
+        entry->segment = active;
+        entry->offset = offset;
+        entry->length = length;
+        entry->hits = 0;
+        entry->next = *link;
+        *link = entry;
+    }
+
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * The function sends a cached object to a client with sendfile().
+ *
+ * @param key The uri used as the cache key.
+ * @param fd The client connection file descriptor.
+ * @param length Set to the length of the object, if it is on disk.
+ *
+ * @return the number of bytes sent, which is less than *length if sendfile()
+ * failed part way, or -1 if nothing was sent: the key is not on disk or
+ * sendfile() failed before writing anything.
+ */
+ssize_t dcache_send(const char *key, int fd, size_t *length) {
+    if (!enabled) {
+        return -1;
+    }
+    pthread_mutex_lock(&dcache_lock);
+    dentry_t *entry = *index_find(key);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&dcache_lock);
+        return -1;
+    }
+    /*pin the segment so compaction cannot close it under sendfile*/
+    segment_t *seg = entry->segment;
+    off_t offset = entry->offset;
+    size_t remaining = entry->length;
+    *length = entry->length;
+    entry->hits++;
+    seg->refcount++;
+    pthread_mutex_unlock(&dcache_lock);
+
+    ssize_t sent = 0;
+    while (remaining > 0) {
+        ssize_t n = sendfile(fd, seg->fd, &offset, remaining);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        remaining -= n;
+        sent += n;
+    }
+
+    pthread_mutex_lock(&dcache_lock);
+    segment_release(seg);
+    pthread_mutex_unlock(&dcache_lock);
+    /*the caller can still fetch the object if the client got nothing*/
+    return sent == 0 && *length > 0 ? -1 : sent;
+}
+
+/**
+ * The function reads a frequently hit object back into memory with pread()
+ * and drops it from the disk index, leaving its bytes for compaction.
+ *
+ * @param key The uri used as the cache key.
+ * @param buf The buffer receiving the web object.
+ * @param maxlen The size of buf.
+ *
+ * @return the length of the object, or -1 if it should stay on disk.
+ */
+ssize_t dcache_promote(const char *key, char *buf, size_t maxlen) {
+    ssize_t length = -1;
+
+    if (!enabled) {
+        return -1;
+    }
+    pthread_mutex_lock(&dcache_lock);
+    dentry_t **link = index_find(key);
+    dentry_t *entry = *link;
+    if (entry != NULL && entry->hits >= DCACHE_PROMOTE_HITS &&
+        entry->length <= maxlen &&
+        pread(entry->segment->fd, buf, entry->length, entry->offset) ==
+            (ssize_t)entry->length) {
+        length = entry->length;
+        index_unlink(link);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return length;
+}
+
+/**
+ * @brief clean disk cache resource
+ * The function `dcache_free` closes and removes all segment files.
+ */
+void dcache_free(void) {
+    int i;
+
+    pthread_mutex_lock(&dcache_lock);
+    for (i = 0; i < DCACHE_BUCKETS; i++) {
+        while (buckets[i] != NULL) {
+            index_unlink(&buckets[i]);
+        }
+    }
+    while (oldest != NULL) {
+        segment_retire(oldest);
+    }
+    enabled = false;
+    pthread_mutex_unlock(&dcache_lock);
+}
@@ -0,0 +1,85 @@
+/**
+ * @file dcache.h
+ * @brief Definitions and interfaces for dcache.c
+ *
+ * The disk cache is a second tier below the in-memory cache. Objects evicted
+ * from memory are appended to log-structured segment files and served back
+ * to clients with sendfile().
+ */
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Largest segment file; smaller budgets use budget / 4 */
+#define DCACHE_SEGMENT_SIZE (16 * 1024 * 1024)
+/* Default disk budget when none is given on the command line */
+#define DCACHE_DEFAULT_BUDGET (256 * 1024 * 1024)
+/* Disk hits before an object is promoted back into memory */
+#define DCACHE_PROMOTE_HITS 2
+
+/**
+ * The function prepares the disk cache directory, removes stale segment files
+ * and opens the first segment.
+ *
+ * @param dir The directory holding the segment files. It is created if it
+ * does not exist.
+ * @param budget The maximum number of bytes the segment files may occupy.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int dcache_init(const char *dir, size_t budget);
+
+/**
+ * The function reports whether dcache_init() has been called successfully.
+ *
+ * @return true if the disk tier is enabled.
+ */
+bool dcache_enabled(void);
+
+/**
+ * The function appends an object to the active segment and indexes it. It has
+ * the signature of a cache eviction hook so it can be given to
+ * cache_set_evict_hook() directly.
+ *
+ * @param key The uri used as the cache key.
+ * @param value The web object.
+ * @param length The length of the web object.
+ */
+void dcache_put(const char *key, const char *value, size_t length);
+
+/**
+ * The function sends a cached object to a client with sendfile().
+ *
+ * @param key The uri used as the cache key.
+ * @param fd The client connection file descriptor.
+ * @param length Set to the length of the object, if it is on disk.
+ *
+ * @return the number of bytes sent, which is less than *length if sendfile()
+ * failed part way, or -1 if nothing was sent: the key is not on disk or
+ * sendfile() failed before writing anything.
+ */
+ssize_t dcache_send(const char *key, int fd, size_t *length);
+
+/**
+ * The function reads a frequently hit object back into memory with pread()
+ * and drops it from the disk index, leaving its bytes for compaction.
+ *
+ * @param key The uri used as the cache key.
+ * @param buf The buffer receiving the web object.
+ * @param maxlen The size of buf.
+ *
+ * @return the length of the object, or -1 if it should stay on disk.
+ */
+ssize_t dcache_promote(const char *key, char *buf, size_t maxlen);
+
+/**
+ * @brief clean disk cache resource
+ * The function `dcache_free` closes and removes all segment files.
+ */
+void dcache_free(void);
+
+#endif /* DCACHE_H */
@@ -0,0 +1,182 @@
+/**
+ * @file listener.c
+ * @brief SO_REUSEPORT listening sockets with optional CPU steering
+ */
+
+/* CPU affinity calls are GNU extensions */
+#define _GNU_SOURCE
+
+#include "listener.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <linux/filter.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * open_reuseport_fd - open_listenfd() with SO_REUSEPORT set before bind
+ */
+static int open_reuseport_fd(const char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, rc, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port,
+                gai_strerror(rc));
+        return -1;
+    }
+
+    for (p = listp; p; p = p->ai_next) {
+        listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (listenfd < 0) {
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                       sizeof(int)) == 0 &&
+            bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(listenfd);
+    }
+
+    freeaddrinfo(listp);
+    if (!p) {
+        return -1;
+    }
+    if (listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * attach_steering - pick the reuseport socket by receiving CPU modulo n
+ *
+ * The program applies to the whole reuseport group, whose socket indices
+ * follow the order the sockets were bound in.
+ */
+static int attach_steering(int fd, int n) {
+    struct sock_filter code[] = {
+        /* A = id of the CPU handling the packet */
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        /* A = A % n */
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, n},
+        /* return A as the socket index */
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                      sizeof(prog));
+}
+
+/**
+ * The function opens n listening sockets on the same port. A single socket is
+ * opened with open_listenfd(); several share the port with SO_REUSEPORT.
+ *
+ * @param port The port to listen on.
+ * @param fds Receives the listening file descriptors.
+ * @param n The number of sockets to open, at most MAX_LISTENERS.
+ * @param steer Attach a BPF program sending each connection to the socket
+ * whose index matches the CPU that received it, modulo n.
+ *
+ * @return 0 on success, -1 on error with no sockets left open.
+ */
+int open_listeners(const char *port, int fds[], int n, bool steer) {
+    int i;
+
+    if (n == 1 && !steer) {
+        fds[0] = open_listenfd(port);
+        return fds[0] < 0 ? -1 : 0;
+    }
+    for (i = 0; i < n; i++) {
+        fds[i] = open_reuseport_fd(port);
+        if (fds[i] < 0) {
+            goto fail;
+        }
+    }
+    if (steer && attach_steering(fds[0], n) < 0) {
+        fprintf(stderr, "Failed to attach steering program: %s\n",
+                strerror(errno));
+        goto fail;
+    }
+    return 0;
+
+fail:
+    while (--i >= 0) {
+        close(fds[i]);
+    }
+    return -1;
+}
+
+/**
+ * The function makes the CPU steering of listening sockets received in a
+ * handoff match this proxy's setting. The steering program belongs to the
+ * reuseport group, so the sockets arrive with whatever the previous proxy
+ * attached; it is either attached again for n sockets or detached.
+ *
+ * @param fds The listening file descriptors.
+ * @param n The number of sockets.
+ * @param steer Attach the steering program, or detach any that is attached.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int steer_listeners(const int fds[], int n, bool steer) {
+    int unused = 0; /*detaching takes no value, but the kernel wants an int*/
+
+    if (steer) {
+        if (attach_steering(fds[0], n) < 0) {
+            fprintf(stderr, "Failed to attach steering program: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+        printf("Attached CPU steering to %d inherited listening sockets\n",
+               n);
+        return 0;
+    }
+    if (setsockopt(fds[0], SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, &unused,
+                   sizeof(unused)) < 0) {
+        /*no program attached, or a socket without SO_REUSEPORT*/
+        if (errno == ENOENT || errno == EINVAL) {
+            return 0;
+        }
+        fprintf(stderr, "Failed to detach steering program: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    printf("Detached CPU steering inherited with the listening sockets\n");
+    return 0;
+}
+
+/**
+ * The function pins the calling thread to one CPU, so that with steering on
+ * an acceptor runs where its connections arrive.
+ *
+ * @param index The acceptor index, wrapped to the number of online CPUs.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int pin_acceptor(int index) {
+    cpu_set_t set;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpu < 1) {
+        return -1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(index % ncpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0
+               ? 0
+               : -1;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file listener.h
+ * @brief Definitions and interfaces for listener.c
+ *
+ * With more than one acceptor, every acceptor thread gets its own listening
+ * socket bound to the same port with SO_REUSEPORT, and the kernel spreads new
+ * connections across them instead of waking a single accept() caller.
+ */
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stdbool.h>
+
+/* Most listening sockets one proxy opens, or receives in a handoff */
+#define MAX_LISTENERS 64
+
+/**
+ * The function opens n listening sockets on the same port. A single socket is
+ * opened with open_listenfd(); several share the port with SO_REUSEPORT.
+ *
+ * @param port The port to listen on.
+ * @param fds Receives the listening file descriptors.
+ * @param n The number of sockets to open, at most MAX_LISTENERS.
+ * @param steer Attach a BPF program sending each connection to the socket
+ * whose index matches the CPU that received it, modulo n.
+ *
+ * @return 0 on success, -1 on error with no sockets left open.
+ */
+int open_listeners(const char *port, int fds[], int n, bool steer);
+
+/**
+ * The function makes the CPU steering of listening sockets received in a
+ * handoff match this proxy's setting. The steering program belongs to the
+ * reuseport group, so the sockets arrive with whatever the previous proxy
+ * attached; it is either attached again for n sockets or detached.
+ *
+ * @param fds The listening file descriptors.
+ * @param n The number of sockets.
+ * @param steer Attach the steering program, or detach any that is attached.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int steer_listeners(const int fds[], int n, bool steer);
+
+/**
+ * The function pins the calling thread to one CPU, so that with steering on
+ * an acceptor runs where its connections arrive.
+ *
+ * @param index The acceptor index, wrapped to the number of online CPUs.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int pin_acceptor(int index);
+
+#endif /* LISTENER_H */
@@ -0,0 +1,209 @@
+/**
+ * @file lockprof.c
+ * @brief Lock contention profiling
+ *
+ * A site is registered the first time it takes its lock, by pushing it onto a
+ * lock-free list, so that sites need no setup and the report finds every one
+ * that ran. All statistics of a site are updated by the thread holding its
+ * lock, which makes them consistent without any further synchronization; the
+ * report takes each lock in turn while copying them.
+ */
+
+#include "lockprof.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef LOCKPROF
+
+static lock_site_t *sites = NULL;
+/*first acquisition of any site, the start of the profile*/
+static uint64_t start_ns = 0;
+
+/*
+ * now_ns - monotonic clock in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * bucket - histogram bucket of a duration, the first power of two above it
+ */
+static int bucket(uint64_t ns) {
+    int i = 0;
+
+    while (i < LOCKPROF_BUCKETS - 1 && ns >= ((uint64_t)1 << i)) {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * register_site - link a site into the list the report walks
+ */
+static void register_site(pthread_mutex_t *mutex, lock_site_t *site,
+                          uint64_t now) {
+    uint64_t unset = 0;
+
+    site->mutex = mutex;
+    site->registered = 1;
+    __atomic_compare_exchange_n(&start_ns, &unset, now, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    site->next = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&sites, &site->next, site, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+/*
+ * percentile - upper bound of the bucket holding a percentile
+ */
+static uint64_t percentile(const uint64_t hist[], unsigned long count,
+                           double pct) {
+    unsigned long seen = 0;
+    int i;
+
+    for (i = 0; i < LOCKPROF_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > 0 && seen >= count * pct / 100) {
+            break;
+        }
+    }
+    return (uint64_t)1 << i;
+}
+
+/*
+ * format_ns - print a duration with a unit that keeps it short
+ */
+static const char *format_ns(char *buf, size_t size, double ns) {
+    if (ns < 1000) {
+        snprintf(buf, size, "%.0fns", ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", ns / 1000);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.1fms", ns / 1000000);
+    } else {
+        snprintf(buf, size, "%.2fs", ns / 1000000000);
+    }
+    return buf;
+}
+
+/*
+ * print_times - one line of totals and percentiles, then the histogram
+ */
+static void print_times(FILE *fp, const char *what, const uint64_t hist[],
+                        uint64_t total, unsigned long count) {
+    char a[16], b[16], c[16], d[16];
+    int i;
+
+    fprintf(fp, "  %s total %s, mean %s, p50 < %s, p99 < %s\n", what,
+            format_ns(a, sizeof(a), total),
+            format_ns(b, sizeof(b), (double)total / count),
+            format_ns(c, sizeof(c), percentile(hist, count, 50)),
+            format_ns(d, sizeof(d), percentile(hist, count, 99)));
+    fprintf(fp, "   ");
+    for (i = 0; i < LOCKPROF_BUCKETS; i++) {
+        if (hist[i] > 0) {
+            fprintf(fp, " <%s:%lu", format_ns(a, sizeof(a), (uint64_t)1 << i),
+                    (unsigned long)hist[i]);
+        }
+    }
+    fprintf(fp, "\n");
+}
+
+/**
+ * The function takes a lock on behalf of a site, recording how long it had to
+ * wait. The statistics of a site are only updated while its lock is held.
+ *
+ * @param mutex The lock.
+ * @param site The critical section about to be entered.
+ */
+void lockprof_lock(pthread_mutex_t *mutex, lock_site_t *site) {
+    uint64_t begin = now_ns(), end;
+    int contended = 0;
+
+    if (pthread_mutex_trylock(mutex) != 0) {
+        contended = 1;
+        pthread_mutex_lock(mutex);
+    }
+    end = now_ns();
+    if (!site->registered) {
+        register_site(mutex, site, begin);
+    }
+    site->acquisitions++;
+    site->contended += contended;
+    site->wait_ns += end - begin;
+    site->wait[bucket(end - begin)]++;
+    site->acquired = end;
+}
+
+/**
+ * The function records how long a site held a lock and releases it.
+ *
+ * @param mutex The lock.
+ * @param site The critical section being left.
+ */
+void lockprof_unlock(pthread_mutex_t *mutex, lock_site_t *site) {
+    uint64_t held = now_ns() - site->acquired;
+
+    site->hold_ns += held;
+    site->hold[bucket(held)]++;
+    pthread_mutex_unlock(mutex);
+}
+
+/**
+ * The function prints the statistics of every site that has taken its lock,
+ * with the wait and hold histograms. It prints nothing without LOCKPROF.
+ *
+ * @param fp The stream to print to.
+ */
+void lockprof_report(FILE *fp) {
+    lock_site_t *site, copy;
+    uint64_t elapsed;
+    char a[16];
+
+    site = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+    if (site == NULL) {
+        return;
+    }
+    elapsed = now_ns() - __atomic_load_n(&start_ns, __ATOMIC_RELAXED);
+    fprintf(fp, "Lock profile over %s\n", format_ns(a, sizeof(a), elapsed));
+    for (; site != NULL; site = site->next) {
+        pthread_mutex_lock(site->mutex);
+        memcpy(&copy, site, sizeof(copy));
+        pthread_mutex_unlock(site->mutex);
+
+        fprintf(fp,
+                "%s at %s: %lu acquisitions, %lu contended (%.1f%%),"
+                " held %.2f%% of the time\n",
+                copy.lock, copy.name, copy.acquisitions, copy.contended,
+                100.0 * copy.contended / copy.acquisitions,
+                100.0 * copy.hold_ns / elapsed);
+        print_times(fp, "wait", copy.wait, copy.wait_ns, copy.acquisitions);
+        print_times(fp, "hold", copy.hold, copy.hold_ns, copy.acquisitions);
+    }
+    fflush(fp);
+}
+
+#else
+
+void lockprof_lock(pthread_mutex_t *mutex, lock_site_t *site) {
+    (void)site;
+    pthread_mutex_lock(mutex);
+}
+
+void lockprof_unlock(pthread_mutex_t *mutex, lock_site_t *site) {
+    (void)site;
+    pthread_mutex_unlock(mutex);
+}
+
+void lockprof_report(FILE *fp) {
+    (void)fp;
+}
+
+#endif /* LOCKPROF */
@@ -0,0 +1,74 @@
+/**
+ * @file lockprof.h
+ * @brief Definitions and interfaces for lockprof.c
+ *
+ * Lock profiling, enabled by adding -DLOCKPROF to the compiler flags (make
+ * proxy-lockprof). Every critical section is a named site; each site counts
+ * its acquisitions and keeps histograms of how long threads waited for the
+ * lock and how long they held it. Without LOCKPROF the site macros compile
+ * down to plain pthread_mutex_lock() and pthread_mutex_unlock().
+ */
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Power of two histogram buckets, the last one ends at about 4 seconds */
+#define LOCKPROF_BUCKETS 32
+
+/*one critical section of one lock*/
+typedef struct LockSite {
+    const char *lock;                /*name of the lock*/
+    const char *name;                /*name of the critical section*/
+    pthread_mutex_t *mutex;          /*the lock, set when registered*/
+    unsigned long acquisitions;      /*times the lock was taken here*/
+    unsigned long contended;         /*times it was already held*/
+    uint64_t wait_ns;                /*total time spent waiting*/
+    uint64_t hold_ns;                /*total time spent holding*/
+    uint64_t wait[LOCKPROF_BUCKETS]; /*wait times, bucket i < 2^i ns*/
+    uint64_t hold[LOCKPROF_BUCKETS]; /*hold times, bucket i < 2^i ns*/
+    uint64_t acquired;               /*when the holder took the lock*/
+    int registered;                  /*linked into the site list*/
+    struct LockSite *next;           /*site list links*/
+} lock_site_t;
+
+#ifdef LOCKPROF
+#define LOCK_SITE(site, lock, name) static lock_site_t site = {lock, name}
+#define site_lock(mutex, site) lockprof_lock(mutex, &site)
+#define site_unlock(mutex, site) lockprof_unlock(mutex, &site)
+#else
+#define LOCK_SITE(site, lock, name)                                            \
+    static const int site##_unused __attribute__((unused)) = 0
+#define site_lock(mutex, site) pthread_mutex_lock(mutex)
+#define site_unlock(mutex, site) pthread_mutex_unlock(mutex)
+#endif
+
+/**
+ * The function takes a lock on behalf of a site, recording how long it had to
+ * wait. The statistics of a site are only updated while its lock is held.
+ *
+ * @param mutex The lock.
+ * @param site The critical section about to be entered.
+ */
+void lockprof_lock(pthread_mutex_t *mutex, lock_site_t *site);
+
+/**
+ * The function records how long a site held a lock and releases it.
+ *
+ * @param mutex The lock.
+ * @param site The critical section being left.
+ */
+void lockprof_unlock(pthread_mutex_t *mutex, lock_site_t *site);
+
+/**
+ * The function prints the statistics of every site that has taken its lock,
+ * with the wait and hold histograms. It prints nothing without LOCKPROF.
+ *
+ * @param fp The stream to print to.
+ */
+void lockprof_report(FILE *fp);
+
+#endif /* LOCKPROF_H */
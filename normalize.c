@@ -0,0 +1,352 @@
+/**
+ * @file normalize.c
+ * @brief Single-pass cache key normalization
+ *
+ * The URI is read once, left to right, and the key is written as it goes.
+ * Query parameters are filtered as each one ends: a dropped parameter is
+ * taken back out of the key by rewinding it. Sorting is the only step that
+ * looks at the key again, and only at the query, once all of it is written.
+ */
+
+#include "normalize.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Most parameters a query can have and still be sorted */
+#define MAX_PARAMS 64
+/* Longest query that can be sorted */
+#define MAX_QUERY 8192
+
+/*the key being written*/
+typedef struct {
+    char *buf;     /*the key*/
+    size_t size;   /*size of buf*/
+    size_t length; /*bytes written so far*/
+    bool full;     /*set once a byte did not fit*/
+} key_writer_t;
+
+/*a query parameter already written to the key*/
+typedef struct {
+    size_t start;  /*offset of the parameter in the query*/
+    size_t length; /*length of name=value*/
+    size_t name;   /*length of the name*/
+} param_t;
+
+static query_mode_t query_mode = QUERY_KEEP;
+static const char *dropped[MAX_DROPPED_PARAMS];
+static int ndropped = 0;
+
+/**
+ * The function chooses what cache keys keep of the query string, QUERY_KEEP
+ * by default. It is called before the first request.
+ *
+ * @param mode The query mode.
+ */
+void normalize_set_query(query_mode_t mode) {
+    query_mode = mode;
+}
+
+/**
+ * The function removes a query parameter from every cache key. It is called
+ * before the first request.
+ *
+ * @param name The parameter name. A trailing '*' matches every name
+ * starting with the rest, e.g. "utm_*".
+ *
+ * @return 0 on success, -1 if MAX_DROPPED_PARAMS names are already dropped.
+ */
+int normalize_drop_param(const char *name) {
+    if (ndropped == MAX_DROPPED_PARAMS) {
+        return -1;
+    }
+    dropped[ndropped++] = name;
+    return 0;
+}
+
+/*
+ * put - append a byte to the key, or note that it is full
+ */
+static void put(key_writer_t *w, char c) {
+    if (w->length + 1 < w->size) {
+        w->buf[w->length++] = c;
+    } else {
+        w->full = true;
+    }
+}
+
+/*
+ * lower - ASCII lowercase, whatever the locale
+ */
+static char lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/*
+ * hex_value - value of a hex digit, -1 if it is not one
+ */
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = lower(c);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/*
+ * unreserved - RFC 3986 characters that never need escaping
+ */
+static bool unreserved(int c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+           c == '~';
+}
+
+/*
+ * put_escaped - append one character or escape of a path or query
+ *
+ * Returns the number of URI bytes consumed.
+ */
+static size_t put_escaped(key_writer_t *w, const char *p) {
+    static const char digits[] = "0123456789ABCDEF";
+    int high, low;
+
+    if (p[0] != '%' || (high = hex_value(p[1])) < 0 ||
+        (low = hex_value(p[2])) < 0) {
+        put(w, p[0]);
+        return 1;
+    }
+    if (unreserved(high * 16 + low)) {
+        put(w, high * 16 + low);
+    } else {
+        put(w, '%');
+        put(w, digits[high]);
+        put(w, digits[low]);
+    }
+    return 3;
+}
+
+/*
+ * is_dropped - check a parameter name against the dropped names
+ */
+static bool is_dropped(const char *name, size_t length) {
+    for (int i = 0; i < ndropped; i++) {
+        size_t n = strlen(dropped[i]);
+        if (n > 0 && dropped[i][n - 1] == '*') {
+            if (length >= n - 1 && memcmp(name, dropped[i], n - 1) == 0) {
+                return true;
+            }
+        } else if (length == n && memcmp(name, dropped[i], n) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * sort_params - reorder the written query by parameter name
+ *
+ * Insertion sort, stable, so repeated names keep their order.
+ */
+static void sort_params(key_writer_t *w, size_t query, param_t *params,
+                        int nparams) {
+    char copy[MAX_QUERY];
+    size_t length = w->length - query;
+    char *out = w->buf + query;
+
+    if (length > sizeof(copy)) {
+        return;
+    }
+    memcpy(copy, out, length);
+    for (int i = 1; i < nparams; i++) {
+        param_t p = params[i];
+        int j = i;
+        while (j > 0) {
+            param_t *q = &params[j - 1];
+            size_t n = p.name < q->name ? p.name : q->name;
+            int order = memcmp(copy + p.start, copy + q->start, n);
+            if (order > 0 || (order == 0 && p.name >= q->name)) {
+                break;
+            }
+            params[j] = *q;
+            j--;
+        }
+        params[j] = p;
+    }
+    for (int i = 0; i < nparams; i++) {
+        if (i > 0) {
+            *out++ = '&';
+        }
+        memcpy(out, copy + params[i].start, params[i].length);
+        out += params[i].length;
+    }
+}
+
+/*
+ * put_query - append the query string, from after the '?' to the fragment
+ *
+ * Returns the number of URI bytes consumed.
+ */
+static size_t put_query(key_writer_t *w, const char *p) {
+    const char *start = p;
+    size_t mark = w->length;
+    size_t query;
+    param_t params[MAX_PARAMS];
+    int nparams = 0;
+    bool sortable = true;
+
+    if (query_mode == QUERY_STRIP) {
+        return strcspn(p, "#");
+    }
+    put(w, '?');
+    query = w->length;
+    while (*p != '\0' && *p != '#') {
+        size_t separator = w->length;
+        size_t param, name = 0;
+        bool named = false;
+
+        if (w->length > query) {
+            put(w, '&');
+        }
+        param = w->length;
+        while (*p != '\0' && *p != '#' && *p != '&') {
+            if (*p == '=' && !named) {
+                name = w->length - param;
+                named = true;
+            }
+            p += put_escaped(w, p);
+        }
+        if (*p == '&') {
+            p++;
+        }
+        if (!named) {
+            name = w->length - param;
+        }
+        /*drop empty and unwanted parameters*/
+        if (w->length == param || is_dropped(w->buf + param, name)) {
+            w->length = separator;
+            continue;
+        }
+        if (nparams < MAX_PARAMS) {
+            params[nparams].start = param - query;
+            params[nparams].length = w->length - param;
+            params[nparams].name = name;
+            nparams++;
+        } else {
+            sortable = false;
+        }
+    }
+    if (w->length == query) {
+        /*nothing kept, no '?' either*/
+        w->length = mark;
+    } else if (query_mode == QUERY_SORT && sortable && nparams > 1) {
+        sort_params(w, query, params, nparams);
+    }
+    return p - start;
+}
+
+/*
+ * default_port - the port a scheme implies, 0 if unknown
+ */
+static unsigned long default_port(const char *scheme, size_t length) {
+    if (length == 4 && memcmp(scheme, "http", 4) == 0) {
+        return 80;
+    }
+    if (length == 5 && memcmp(scheme, "https", 5) == 0) {
+        return 443;
+    }
+    return 0;
+}
+
+/**
+ * The function writes the cache key for a request URI.
+ *
+ * @param uri The URI from the request line.
+ * @param key Receives the key, NUL-terminated.
+ * @param size The size of key.
+ *
+ * @return 0 on success, -1 if the key did not fit.
+ */
+int normalize_key(const char *uri, char *key, size_t size) {
+    key_writer_t w = {key, size, 0, false};
+    const char *p = uri;
+    const char *scheme = uri;
+    bool absolute;
+
+    if (size == 0) {
+        return -1;
+    }
+    /*scheme, lowercased*/
+    while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+           (*p >= '0' && *p <= '9') || *p == '+' || *p == '-' || *p == '.') {
+        p++;
+    }
+    absolute = p > scheme && strncmp(p, "://", 3) == 0;
+    if (absolute) {
+        size_t scheme_length = p - scheme;
+
+        for (p = scheme; *p != ':'; p++) {
+            put(&w, lower(*p));
+        }
+        put(&w, ':');
+        put(&w, '/');
+        put(&w, '/');
+        p += 3;
+        /*host, lowercased*/
+        if (*p == '[') {
+            while (*p != '\0' && *p != ']') {
+                put(&w, lower(*p++));
+            }
+        }
+        while (*p != '\0' && strchr(":/?#", *p) == NULL) {
+            put(&w, lower(*p++));
+        }
+        /*port, unless it is the default*/
+        if (*p == ':') {
+            const char *digits = ++p;
+            unsigned long port = 0;
+
+            while (*p >= '0' && *p <= '9' && port <= 65535) {
+                port = port * 10 + (*p++ - '0');
+            }
+            if (port > 65535 || (*p != '\0' && strchr("/?#", *p) == NULL)) {
+                /*not a port, keep it as it was*/
+                put(&w, ':');
+                p = digits;
+            } else if (p > digits &&
+                       port != default_port(key, scheme_length)) {
+                char text[8];
+                int n = snprintf(text, sizeof(text), ":%lu", port);
+                for (int i = 0; i < n; i++) {
+                    put(&w, text[i]);
+                }
+            }
+        }
+        while (*p != '\0' && strchr(":/?#", *p) == NULL) {
+            put(&w, *p++);
+        }
+        if (*p == '\0' || *p == '?' || *p == '#') {
+            put(&w, '/');
+        }
+    } else {
+        p = uri;
+    }
+    /*path*/
+    while (*p != '\0' && *p != '?' && *p != '#') {
+        p += put_escaped(&w, p);
+    }
+    if (*p == '?') {
+        p++;
+        p += put_query(&w, p);
+    }
+    /*the fragment is never part of the key*/
+    if (w.full) {
+        return -1;
+    }
+    key[w.length] = '\0';
+    return 0;
+}
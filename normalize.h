@@ -0,0 +1,67 @@
+/**
+ * @file normalize.h
+ * @brief Definitions and interfaces for normalize.c
+ *
+ * Cache keys are built from the request URI in one pass, so that spellings
+ * of the same URL share one cache entry and one origin fetch:
+ *
+ * - the scheme and host are lowercased;
+ * - the port is dropped when it is the scheme's default (80 for http, 443
+ *   for https), and written without leading zeros otherwise;
+ * - an empty path becomes "/";
+ * - percent-encoded unreserved characters (letters, digits, "-._~") are
+ *   decoded, and the hex digits of every other escape are uppercased;
+ * - the fragment is removed.
+ *
+ * The query string is kept as is by default. It can be removed entirely, or
+ * its parameters sorted by name, and named parameters, such as tracking
+ * parameters, can be dropped from it. Only the key is normalized; the
+ * request sent to the origin is unchanged.
+ */
+
+#ifndef NORMALIZE_H
+#define NORMALIZE_H
+
+#include <stddef.h>
+
+/* Most parameter names normalize_drop_param() accepts */
+#define MAX_DROPPED_PARAMS 32
+
+/*what cache keys keep of the query string*/
+typedef enum {
+    QUERY_KEEP,  /*keep the parameters in order*/
+    QUERY_SORT,  /*sort the parameters by name*/
+    QUERY_STRIP, /*remove the query string*/
+} query_mode_t;
+
+/**
+ * The function chooses what cache keys keep of the query string, QUERY_KEEP
+ * by default. It is called before the first request.
+ *
+ * @param mode The query mode.
+ */
+void normalize_set_query(query_mode_t mode);
+
+/**
+ * The function removes a query parameter from every cache key. It is called
+ * before the first request.
+ *
+ * @param name The parameter name. A trailing '*' matches every name
+ * starting with the rest, e.g. "utm_*".
+ *
+ * @return 0 on success, -1 if MAX_DROPPED_PARAMS names are already dropped.
+ */
+int normalize_drop_param(const char *name);
+
+/**
+ * The function writes the cache key for a request URI.
+ *
+ * @param uri The URI from the request line.
+ * @param key Receives the key, NUL-terminated.
+ * @param size The size of key.
+ *
+ * @return 0 on success, -1 if the key did not fit.
+ */
+int normalize_key(const char *uri, char *key, size_t size);
+
+#endif /* NORMALIZE_H */
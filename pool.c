@@ -0,0 +1,49 @@
+/**
+ * @file pool.c
+ * @brief Pools of recycled fixed-size objects
+ */
+
+#include "pool.h"
+
+#include <stdlib.h>
+
+/**
+ * The function takes an object from a pool, allocating one if none is idle.
+ *
+ * @param pool The pool.
+ *
+ * @return the object, or NULL if out of memory.
+ */
+void *pool_get(pool_t *pool) {
+    void *object;
+
+    pthread_mutex_lock(&pool->lock);
+    object = pool->idle;
+    if (object != NULL) {
+        pool->idle = *(void **)object;
+        pool->nidle--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return object != NULL ? object : malloc(pool->size);
+}
+
+/**
+ * The function returns an object to its pool.
+ *
+ * @param pool The pool.
+ * @param object The object, may be NULL.
+ */
+void pool_put(pool_t *pool, void *object) {
+    if (object == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nidle < pool->max_idle) {
+        *(void **)object = pool->idle;
+        pool->idle = object;
+        pool->nidle++;
+        object = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(object);
+}
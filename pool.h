@@ -0,0 +1,45 @@
+/**
+ * @file pool.h
+ * @brief Definitions and interfaces for pool.c
+ *
+ * Pools of fixed-size objects that are recycled instead of going back to
+ * malloc, so that the buffers of a busy proxy stay allocated and their pages
+ * stay mapped. Objects come back uninitialized, nothing is zeroed.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*a pool of objects of one size*/
+typedef struct Pool {
+    size_t size;          /*bytes in each object*/
+    unsigned max_idle;    /*idle objects kept, the rest are freed*/
+    pthread_mutex_t lock; /*protects the idle list*/
+    void *idle;           /*idle objects, linked through their first word*/
+    unsigned nidle;       /*number of idle objects*/
+} pool_t;
+
+#define POOL_INITIALIZER(size, max_idle)                                       \
+    { (size), (max_idle), PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+
+/**
+ * The function takes an object from a pool, allocating one if none is idle.
+ *
+ * @param pool The pool.
+ *
+ * @return the object, or NULL if out of memory.
+ */
+void *pool_get(pool_t *pool);
+
+/**
+ * The function returns an object to its pool.
+ *
+ * @param pool The pool.
+ * @param object The object, may be NULL.
+ */
+void pool_put(pool_t *pool, void *object);
+
+#endif /* POOL_H */
@@ -0,0 +1,133 @@
+/**
+ * @file probes.h
+ * @brief Static tracepoints on the request lifecycle
+ *
+ * When <sys/sdt.h> (systemtap-sdt-dev) is installed, every PROBE macro
+ * places a USDT probe in the "proxy" provider. A probe is a single nop in
+ * the code plus a note in the ELF file, so it costs nothing until bpftrace
+ * or perf attaches to it, e.g.
+ *
+ *     bpftrace -e 'usdt:./proxy:first__byte { @ = hist(arg1); }'
+ *
+ * Every probe also has a USDT semaphore, which tracers raise while they are
+ * attached. The macros test it first, so their arguments, and the clock
+ * reads behind the durations, are only evaluated while someone listens; a
+ * request already in flight when a tracer attaches reports 0 for the
+ * durations it did not time. Without the header, or with -DNO_PROBES, the
+ * macros expand to nothing, their arguments are not evaluated and
+ * probe_clock() is constant zero.
+ *
+ * Each request runs on its own thread, so probes of one request can be
+ * matched by thread id. Durations are in nanoseconds:
+ *
+ *     accept(fd)
+ *     parse__done(uri, ns since accept)
+ *     cache__hit(uri, size, tier)            tier 0 memory, 1 snapshot, 2 disk
+ *     cache__miss(uri)
+ *     upstream__connect(uri, host, ns spent connecting)
+ *     first__byte(uri, ns since the request was sent)
+ *     cache__insert(uri, size)
+ *     cache__evict(uri, size)
+ *     request__done(uri, ns since accept)    uri NULL if none was parsed
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <stdint.h>
+#include <time.h>
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+/*weak, so every file including this header can define them*/
+#define PROBE_SEMAPHORE(name)                                                  \
+    unsigned short proxy_##name##_semaphore                                    \
+        __attribute__((weak, section(".probes")))
+PROBE_SEMAPHORE(accept);
+PROBE_SEMAPHORE(parse__done);
+PROBE_SEMAPHORE(cache__hit);
+PROBE_SEMAPHORE(cache__miss);
+PROBE_SEMAPHORE(upstream__connect);
+PROBE_SEMAPHORE(first__byte);
+PROBE_SEMAPHORE(cache__insert);
+PROBE_SEMAPHORE(cache__evict);
+PROBE_SEMAPHORE(request__done);
+
+#define PROBE_ENABLED(name) __builtin_expect(proxy_##name##_semaphore != 0, 0)
+#define PROBE1(name, a)                                                        \
+    do {                                                                       \
+        if (PROBE_ENABLED(name)) {                                             \
+            DTRACE_PROBE1(proxy, name, a);                                     \
+        }                                                                      \
+    } while (0)
+#define PROBE2(name, a, b)                                                     \
+    do {                                                                       \
+        if (PROBE_ENABLED(name)) {                                             \
+            DTRACE_PROBE2(proxy, name, a, b);                                  \
+        }                                                                      \
+    } while (0)
+#define PROBE3(name, a, b, c)                                                  \
+    do {                                                                       \
+        if (PROBE_ENABLED(name)) {                                             \
+            DTRACE_PROBE3(proxy, name, a, b, c);                               \
+        }                                                                      \
+    } while (0)
+#else
+#define PROBE_ENABLED(name) 0
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
+/* Tiers a cache hit can be served from */
+#define PROBE_TIER_MEMORY 0
+#define PROBE_TIER_SNAPSHOT 1
+#define PROBE_TIER_DISK 2
+
+/**
+ * The function reads the monotonic clock for probe durations.
+ *
+ * @return the time in nanoseconds, 0 when probes are compiled out.
+ */
+static inline uint64_t probe_clock(void) {
+#ifdef HAVE_PROBES
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * The function reads the clock for the start of a duration, if a probe that
+ * reports it is enabled.
+ *
+ * @param enabled PROBE_ENABLED() of the probes reporting the duration.
+ *
+ * @return the time in nanoseconds, 0 when no such probe is enabled.
+ */
+static inline uint64_t probe_start(int enabled) {
+    return enabled ? probe_clock() : 0;
+}
+
+/**
+ * The function measures a duration started by probe_start().
+ *
+ * @param start The value probe_start() returned.
+ *
+ * @return the nanoseconds since start, 0 if the start was not timed.
+ */
+static inline uint64_t probe_since(uint64_t start) {
+    return start != 0 ? probe_clock() - start : 0;
+}
+
+#endif /* PROBES_H */
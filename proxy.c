@@ -19,14 +19,29 @@
 #include <unistd.h>
 
 #include "cache.h"
+#include "dcache.h"
 #include "http_parser.h"
+#include "listener.h"
+#include "lockprof.h"
+#include "normalize.h"
+#include "pool.h"
+#include "probes.h"
+#include "rcu.h"
+#include "snapshot.h"
+#include "timer.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "vary.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 
 /*
  * Debug macros, which can be enabled by adding -DDEBUG in the Makefile
@@ -48,6 +63,11 @@
 #define MAX_OBJECT_SIZE (100 * 1024)
 #define HOSTLEN 256
 #define SERVLEN 8
+/*
+ * Connection threads keep their buffers in the heap, the stack only needs room
+ * for getaddrinfo() and stdio
+ */
+#define CONN_STACK_SIZE (128 * 1024)
 
 /*
  * String to use for the User-Agent header.
@@ -59,19 +79,117 @@ static const char *header_user_agent = "Mozilla/5.0"
 static const char *connection =
     "Connection: close\r\nProxy-Connection: close\r\n";
 pthread_mutex_t mutex;
+/*critical sections of the cache lock, profiled with -DLOCKPROF*/
+LOCK_SITE(add_site, "cache", "cache_insert");
+LOCK_SITE(promote_site, "cache", "promote_block");
+LOCK_SITE(restore_site, "cache", "restore_block");
+LOCK_SITE(variant_site, "cache", "insert_variant");
+LOCK_SITE(snapshot_site, "cache", "save_snapshot");
+LOCK_SITE(handoff_site, "cache", "prepare_handoff");
+/*snapshot file for warm restarts, and seconds between periodic saves*/
+static const char *snapshot_path = NULL;
+static int snapshot_interval = 0;
+/*seconds in-flight connections get to finish once shutdown starts*/
+static int drain_timeout = 10;
+/*set when the proxy stops accepting, and when a successor took over*/
+static volatile int stopping = 0;
+static volatile int handed_off = 0;
+/*pipe that wakes the accept loop when shutdown starts*/
+static int wake_fds[2];
+/*listening sockets, one per acceptor, and the upgrade control socket*/
+static int listenfds[MAX_LISTENERS];
+static int nlisteners = 1;
+static bool steer_acceptors = false;
+static int control_fd = -1;
+/*number of connection threads still running*/
+static int active_connections = 0;
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_done = PTHREAD_COND_INITIALIZER;
+/*network I/O through io_uring instead of blocking calls*/
+static bool use_uring = false;
+/*access log in the trace format bench/cachesim replays*/
+static FILE *access_log = NULL;
 
 /* Typedef for convenience */
 typedef struct sockaddr SA;
 
+/*phases of a connection, each with its own deadline*/
+typedef enum {
+    PHASE_HEADER,     /*reading the request from the client*/
+    PHASE_CONNECT,    /*connecting to the origin server*/
+    PHASE_FIRST_BYTE, /*waiting for the start of the response*/
+    PHASE_IDLE,       /*relaying, reset whenever data moves*/
+    PHASE_COUNT
+} phase_t;
+
+static const char *phase_names[PHASE_COUNT] = {"header", "connect",
+                                               "first-byte", "idle"};
+/*milliseconds allowed in each phase, 0 disables the deadline*/
+static unsigned phase_timeouts[PHASE_COUNT] = {30000, 10000, 60000, 60000};
+/*number of connections timed out in each phase*/
+static unsigned long timeout_counts[PHASE_COUNT];
+
+/*buffers for the request, borrowed once the client has sent something*/
+typedef struct {
+    rio_t rio;             // Buffered reads from the client
+    char line[MAXLINE];    // Request line or header being parsed
+    char key[MAXLINE];     // Cache key, the normalized uri
+    char request[MAXLINE]; // Request forwarded to the origin
+    char vary[MAXLINE];    // Headers the object varies on, if it does
+    char variant[MAXLINE]; // Cache key of the variant requested
+    header_t *headers[VARY_MAX_HEADERS]; // Request headers, for variant keys
+    int nheaders;                        // Headers parsed, even if not kept
+} request_t;
+
+/*buffers for the response, only held by a connection while it uses them*/
 typedef struct {
-    struct sockaddr_in addr; // Socket address
-    socklen_t addrlen;       // Socket address length
-    int connfd;              // Client connection file descriptor
-    char host[HOSTLEN];      // Client host
-    char serv[SERVLEN];      // Client service (port)
+    rio_t rio;                   // Buffered reads from the origin
+    char chunk[MAXLINE];         // One read from the origin
+    char value[MAX_OBJECT_SIZE]; // The object, copied for the cache
+} fetch_t;
+
+typedef struct {
+    struct sockaddr_storage addr; // Socket address, IPv4 or IPv6
+    socklen_t addrlen;            // Socket address length
+    int connfd;                   // Client connection file descriptor
+    char host[HOSTLEN];           // Client host
+    char serv[SERVLEN];           // Client service (port)
+    int server_fd;                // Origin connection, -1 if none
+    phase_t phase;                // Phase the timer is armed for
+    int timed_out;                // Phase that timed out, -1 if none
+    wheel_timer_t timer;          // Deadline of the current phase
+    uint64_t accepted;            // Accept time, for tracepoints
+    uint64_t mark;                // Start of the step being traced
+    const char *uri;              // Requested uri, for tracepoints
+    request_t *req;               // Request buffers, NULL until needed
+    fetch_t *fetch;               // Response buffers, NULL until needed
 } client_info;
 
+/*recycled connection state and I/O buffers*/
+static pool_t client_pool = POOL_INITIALIZER(sizeof(client_info), 1024);
+static pool_t request_pool = POOL_INITIALIZER(sizeof(request_t), 64);
+static pool_t fetch_pool = POOL_INITIALIZER(sizeof(fetch_t), 32);
+
 void process_request(client_info *client);
+void promote_block(char key[MAXLINE]);
+void restore_block(char key[], const char *value, size_t length);
+void insert_variant(char key[], char vary[], char variant[], char *value,
+                    size_t length);
+ssize_t serve_memory(client_info *client, char *key);
+int open_origin(client_info *client, const char *host, const char *port);
+void save_snapshot(void);
+void start_connection(client_info *client);
+void request_stop(void);
+int drain_connections(void);
+void accept_loop(int listenfd);
+void accept_connection(int connfd);
+void set_phase(client_info *client, phase_t phase);
+void relay_progress(void *arg, size_t received);
+int connect_server(client_info *client, const char *host, const char *port);
+void print_stats(void);
+void log_access(const char *key, size_t size);
+size_t parse_size(const char *arg);
+int parse_timeouts(const char *arg);
 
 void clienterror(int fd, const char *errnum, const char *shortmsg,
                  const char *longmsg);
@@ -161,6 +279,288 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
     }
 }
 
+/**
+ * The function appends an object served to a client to the access log as
+ * "uri size timestamp", if logging is enabled.
+ *
+ * @param key The uri of the object.
+ * @param size The number of bytes sent.
+ */
+void log_access(const char *key, size_t size) {
+    struct timespec now;
+
+    if (access_log == NULL) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(access_log, "%s %zu %ld.%03ld\n", key, size, (long)now.tv_sec,
+            now.tv_nsec / 1000000);
+}
+
+/**
+ * The function runs on the timer thread when a connection overstays its
+ * phase. It shuts down the socket the connection is blocked on, which makes
+ * the pending read, write or connect return.
+ *
+ * @param timer The timer embedded in a client_info.
+ */
+void connection_timeout(wheel_timer_t *timer) {
+    client_info *client =
+        (client_info *)((char *)timer - offsetof(client_info, timer));
+
+    client->timed_out = client->phase;
+    timeout_counts[client->phase]++;
+    if (client->phase != PHASE_CONNECT && client->phase != PHASE_FIRST_BYTE) {
+        shutdown(client->connfd, SHUT_RDWR);
+    }
+    if (client->phase != PHASE_HEADER && client->server_fd >= 0) {
+        shutdown(client->server_fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * The function moves a connection to a new phase and arms its deadline.
+ *
+ * @param client The client connection.
+ * @param phase The phase being entered.
+ */
+void set_phase(client_info *client, phase_t phase) {
+    /*takes the wheel lock only if the deadline comes earlier*/
+    if (phase_timeouts[phase] > 0) {
+        timer_arm(&client->timer, phase_timeouts[phase], connection_timeout);
+    } else {
+        timer_cancel(&client->timer);
+    }
+    client->phase = phase;
+}
+
+/**
+ * The function is called for every chunk of the response received from the
+ * origin. The first one switches to the idle deadline, the others extend it.
+ *
+ * @param arg The client connection.
+ * @param received The number of bytes received before this chunk.
+ */
+void relay_progress(void *arg, size_t received) {
+    client_info *client = (client_info *)arg;
+
+    if (received == 0) {
+        set_phase(client, PHASE_IDLE);
+        PROBE2(first__byte, client->uri, probe_since(client->mark));
+    } else {
+        timer_touch(&client->timer, phase_timeouts[PHASE_IDLE]);
+    }
+}
+
+/**
+ * The function connects to the origin server like open_clientfd(), but
+ * publishes each socket in the client so the connect deadline can abort it.
+ *
+ * @param client The client connection, server_fd is set on success.
+ * @param host The origin host.
+ * @param port The origin port.
+ *
+ * @return 0 on success, -1 on error or timeout.
+ */
+int connect_server(client_info *client, const char *host, const char *port) {
+    struct addrinfo hints, *listp, *p;
+    int fd, rc;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(host, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", host, port,
+                gai_strerror(rc));
+        return -1;
+    }
+
+    for (p = listp; p != NULL; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        client->server_fd = fd;
+        set_phase(client, PHASE_CONNECT);
+        rc = connect(fd, p->ai_addr, p->ai_addrlen);
+        /*disarmed before the fd can be closed and its number reused*/
+        timer_cancel(&client->timer);
+        if (rc == 0) {
+            break;
+        }
+        client->server_fd = -1;
+        close(fd);
+        if (client->timed_out >= 0) {
+            break;
+        }
+    }
+    freeaddrinfo(listp);
+    return client->server_fd >= 0 ? 0 : -1;
+}
+
+/**
+ * The function moves an object that keeps getting hit on disk back into the
+ * memory cache.
+ *
+ * @param key The uri used as the cache key.
+ */
+void promote_block(char key[MAXLINE]) {
+    fetch_t *fetch = pool_get(&fetch_pool);
+    if (fetch == NULL) {
+        return;
+    }
+    ssize_t length = dcache_promote(key, fetch->value, MAX_OBJECT_SIZE);
+    block_t *block = length >= 0 ? block_init(key, fetch->value, length) : NULL;
+    pool_put(&fetch_pool, fetch);
+    if (block != NULL) {
+        retired_t retired;
+        site_lock(&mutex, promote_site);
+        cache_insert(block, &retired);
+        site_unlock(&mutex, promote_site);
+        cache_release(&retired);
+    }
+}
+
+/**
+ * The function copies an object from the snapshot into the memory cache.
+ *
+ * @param key The uri used as the cache key.
+ * @param value The web object inside the snapshot mapping.
+ * @param length The length of the web object.
+ */
+void restore_block(char key[], const char *value, size_t length) {
+    block_t *block = block_init(key, value, length);
+    retired_t retired;
+
+    if (block == NULL) {
+        return;
+    }
+    site_lock(&mutex, restore_site);
+    cache_insert(block, &retired);
+    site_unlock(&mutex, restore_site);
+    cache_release(&retired);
+}
+
+/**
+ * The function caches a response that varies: the vary marker of its uri,
+ * unless it is cached already, then the variant itself.
+ *
+ * @param key The uri used as the cache key.
+ * @param vary The header names the response varies on.
+ * @param variant The variant key of the request.
+ * @param value The response.
+ * @param length The length of the response.
+ */
+void insert_variant(char key[], char vary[], char variant[], char *value,
+                    size_t length) {
+    block_t *marker = block_init(key, vary, strlen(vary));
+    block_t *block = block_init(variant, value, length);
+    retired_t marker_retired, retired;
+    block_t *cached;
+
+    if (marker == NULL || block == NULL) {
+        free(marker);
+        free(block);
+        return;
+    }
+    marker->kind = BLOCK_VARY;
+    block->kind = BLOCK_VARIANT;
+    site_lock(&mutex, variant_site);
+    /*a plain object, or a marker naming other headers, is left alone*/
+    cached = chceck_cache_repeat(key);
+    if (cached != NULL &&
+        (cached->kind != BLOCK_VARY ||
+         cached->value_length != marker->value_length ||
+         memcmp(cached->value, marker->value, marker->value_length) != 0)) {
+        site_unlock(&mutex, variant_site);
+        free(marker);
+        free(block);
+        return;
+    }
+    cache_insert(marker, &marker_retired);
+    cache_insert(block, &retired);
+    site_unlock(&mutex, variant_site);
+    cache_release(&marker_retired);
+    cache_release(&retired);
+}
+
+/**
+ * The function serves an object from the memory cache. If the uri's object
+ * varies, the header names it varies on are left in the request buffers.
+ *
+ * @param client The client connection.
+ * @param key The uri, or the variant key.
+ *
+ * @return the length served, or -1 if the key is not cached.
+ */
+ssize_t serve_memory(client_info *client, char *key) {
+    /*no cache lock, the block stays valid until the section ends*/
+    int epoch = rcu_read_lock();
+    block_t *block = search_cache(key);
+    char *tmp = client->fetch->value;
+    size_t length;
+
+    if (block == NULL || block->kind == BLOCK_VARY) {
+        if (block != NULL) {
+            memcpy(client->req->vary, block->value, block->value_length);
+            client->req->vary[block->value_length] = '\0';
+        }
+        rcu_read_unlock(epoch);
+        return -1;
+    }
+    length = block->value_length;
+    memcpy(tmp, block->value, length);
+    rcu_read_unlock(epoch);
+    PROBE3(cache__hit, client->uri, length, PROBE_TIER_MEMORY);
+
+    set_phase(client, PHASE_IDLE);
+    rio_writen(client->connfd, tmp, length);
+    log_access(client->uri, length);
+    return length;
+}
+
+/**
+ * The function connects to the origin for a cache miss and gets ready to
+ * read its response.
+ *
+ * @param client The client connection.
+ * @param host The origin host.
+ * @param port The origin port.
+ *
+ * @return 0 on success, -1 on error or timeout, after telling the client.
+ */
+int open_origin(client_info *client, const char *host, const char *port) {
+    client->mark = probe_start(PROBE_ENABLED(upstream__connect));
+    if (connect_server(client, host, port) < 0) {
+        if (client->timed_out == PHASE_CONNECT) {
+            clienterror(client->connfd, "504", "Gateway Timeout",
+                        "Proxy timed out connecting to the server");
+        }
+        sio_printf("Connection failed\n");
+        return -1;
+    }
+    PROBE3(upstream__connect, client->uri, host, probe_since(client->mark));
+    set_phase(client, PHASE_HEADER);
+    rio_readinitb(&client->fetch->rio, client->server_fd);
+    return 0;
+}
+
+/**
+ * The function saves the memory cache to the snapshot file.
+ */
+void save_snapshot(void) {
+    snapshot_objects_t objects = {NULL, 0, 0};
+
+    site_lock(&mutex, snapshot_site);
+    /*copies, so the file is written with no lock or read section held*/
+    snapshot_collect(&objects);
+    site_unlock(&mutex, snapshot_site);
+    int rc = snapshot_save(snapshot_path, &objects);
+    if (rc < 0) {
+        fprintf(stderr, "Failed to save snapshot: %s\n", snapshot_path);
+    }
+}
+
 /**
  * The function `process_request` handles incoming client requests, retrieves
  * information from the request, sends it to a server, and caches the response
@@ -172,6 +572,11 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
  *
  */
 void process_request(client_info *client) {
+    if (client->addrlen == 0) {
+        /*accepted by the io_uring engine, which does not collect addresses*/
+        client->addrlen = sizeof(client->addr);
+        getpeername(client->connfd, (SA *)&client->addr, &client->addrlen);
+    }
     int res = getnameinfo((SA *)&client->addr, client->addrlen, client->host,
                           sizeof(client->host), client->serv,
                           sizeof(client->serv), 0);
@@ -181,31 +586,40 @@ void process_request(client_info *client) {
         fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
     }
 
-    rio_t rio, rio_server;
+    set_phase(client, PHASE_HEADER);
+    /*an idle connection holds no buffers, wait for the request to start*/
+    struct pollfd readable = {client->connfd, POLLIN, 0};
+    while (poll(&readable, 1, -1) < 0 && errno == EINTR) {
+    }
+    client->req = pool_get(&request_pool);
+    if (client->req == NULL) {
+        clienterror(client->connfd, "503", "Service Unavailable",
+                    "Proxy is out of memory");
+        return;
+    }
+    rio_t *rio = &client->req->rio;
 
-    rio_readinitb(&rio, client->connfd);
+    rio_readinitb(rio, client->connfd);
     /*buffer*/
-    char buf[MAXLINE];
-
-    /*reset buf*/
-    memset(buf, 0, MAXLINE);
+    char *buf = client->req->line;
     /*cache key*/
-    char key[MAXLINE];
-    /*reset cache key*/
-    memset(key, 0, MAXLINE);
+    char *key = client->req->key;
+    key[0] = '\0';
+    /*set when the object varies, the variant is looked up after the headers*/
+    client->req->vary[0] = '\0';
+    client->req->nheaders = 0;
 
     int n;
     const char *method, *path, *host, *port, *uri;
     parser_t *parser = parser_new();
-    char new_request[MAXLINE];
+    char *new_request = client->req->request;
     // reset request line
-    memset(new_request, 0, MAXLINE);
+    new_request[0] = '\0';
 
     parser_state state;
 
-    int server_fd = 0; /*server fd*/
     /*read from client*/
-    while ((n = rio_readlineb(&rio, buf, sizeof(buf))) > 0 &&
+    while ((n = rio_readlineb(rio, buf, MAXLINE)) > 0 &&
            (strcmp(buf, "\r\n") != 0)) {
 
         state = parser_parse_line(parser, buf);
@@ -229,33 +643,66 @@ void process_request(client_info *client) {
                 return;
             }
             parser_retrieve(parser, URI, &uri);
+            client->fetch = pool_get(&fetch_pool);
+            if (client->fetch == NULL) {
+                parser_free(parser);
+                clienterror(client->connfd, "503", "Service Unavailable",
+                            "Proxy is out of memory");
+                return;
+            }
 
-            /*copy uri to key*/
-            memcpy(key, uri, strlen(uri));
+            /*normalize uri to key, or copy it if it does not fit*/
+            if (normalize_key(uri, key, MAXLINE) < 0) {
+                strncpy(key, uri, MAXLINE - 1);
+                key[MAXLINE - 1] = '\0';
+            }
+            client->uri = key;
+            PROBE2(parse__done, key, probe_since(client->accepted));
 
             /*check if key in the cache*/
-            /*lock the global cache*/
-            pthread_mutex_lock(&mutex);
-
-            /*search key from the cache*/
-            block_t *block = search_cache(key);
-            /*if block is null, meaning it return the web object from cache*/
-            if (block != NULL) {
-                /*store cache value in the tmp*/
-                char tmp[MAX_OBJECT_SIZE];
-                memset(tmp, 0, MAX_OBJECT_SIZE);
-
-                size_t length = block->value_length;
-                memcpy(tmp, block->value, length);
-                /*unlock*/
-                pthread_mutex_unlock(&mutex);
-
-                rio_writen(client->connfd, tmp, length);
+            if (serve_memory(client, key) >= 0) {
+                parser_free(parser);
+                return;
+            }
+            /*the variant depends on headers that are not read yet*/
+            bool varies = client->req->vary[0] != '\0';
+
+            /*warm restart: serve the object from the mapped snapshot*/
+            const char *warm;
+            size_t warm_length;
+            if (!varies && snapshot_find(key, &warm, &warm_length)) {
+                PROBE3(cache__hit, key, warm_length, PROBE_TIER_SNAPSHOT);
+                set_phase(client, PHASE_IDLE);
+                rio_writen(client->connfd, warm, warm_length);
+                log_access(key, warm_length);
+                restore_block(key, warm, warm_length);
+                parser_free(parser);
+                return;
+            }
+
+            /*second tier: send the object straight from its segment file*/
+            ssize_t sent = -1;
+            size_t disk_length = 0;
+            if (!varies) {
+                set_phase(client, PHASE_IDLE);
+                sent = dcache_send(key, client->connfd, &disk_length);
+            }
+            if (sent >= 0 && (size_t)sent == disk_length) {
+                PROBE3(cache__hit, key, sent, PROBE_TIER_DISK);
+                log_access(key, sent);
+                promote_block(key);
+                parser_free(parser);
+                return;
+            }
+            /*cut short, the client already has part of the object*/
+            if (sent >= 0) {
+                parser_free(parser);
                 return;
             }
-            /*unlock*/
-            pthread_mutex_unlock(&mutex);
 
+            if (!varies) {
+                PROBE1(cache__miss, key);
+            }
             int result;
 
             /*get path,host ,port*/
@@ -283,15 +730,11 @@ void process_request(client_info *client) {
                 return;
             }
 
-            /*open server*/
-            server_fd = open_clientfd(host, port);
-            /*error on open server*/
-            if (server_fd < 0) {
-                sio_printf("Connection failed\n");
-                close(server_fd);
+            /*open server, after the headers if the variant may be cached*/
+            if (!varies && open_origin(client, host, port) < 0) {
+                parser_free(parser);
                 return;
             }
-            rio_readinitb(&rio_server, server_fd);
 
             /*generate request*/
             generate_request(new_request, host, path, port);
@@ -302,6 +745,11 @@ void process_request(client_info *client) {
             header_t *header;
 
             while ((header = parser_retrieve_next_header(parser)) != NULL) {
+                request_t *req = client->req;
+                if (req->nheaders < VARY_MAX_HEADERS) {
+                    req->headers[req->nheaders] = header;
+                }
+                req->nheaders++;
                 //  skip this host connection.. part
                 if ((!strcmp(header->name, "Host") ||
                      !strcmp(header->name, "Connection") ||
@@ -315,6 +763,12 @@ void process_request(client_info *client) {
             }
         }
     }
+    /*slow client, its socket has already been shut down*/
+    timer_cancel(&client->timer);
+    if (client->timed_out >= 0) {
+        parser_free(parser);
+        return;
+    }
     // client error
     if (strcmp(new_request, "") == 0) {
 
@@ -322,33 +776,57 @@ void process_request(client_info *client) {
 
         clienterror(client->connfd, "400", "Bad Request",
                     "Proxy received a malformed request");
-        close(server_fd);
 
         return;
     }
 
     strcat(new_request, "\r\n");
-    parser_free(parser);
 
-    /*send request to server*/
-    if ((rio_writen(server_fd, new_request, MAXLINE)) == -1) {
-        sio_printf("error\n");
+    /*the object varies, serve the variant or fetch it now*/
+    if (client->req->vary[0] != '\0') {
+        if (vary_key(key, client->req->vary, client->req->headers,
+                     client->req->nheaders, client->req->variant,
+                     MAXLINE) == 0 &&
+            serve_memory(client, client->req->variant) >= 0) {
+            parser_free(parser);
+            return;
+        }
+        PROBE1(cache__miss, key);
+        if (open_origin(client, host, port) < 0) {
+            parser_free(parser);
+            return;
+        }
     }
+
+    /*send request to server*/
+    set_phase(client, PHASE_FIRST_BYTE);
+    client->mark = probe_start(PROBE_ENABLED(first__byte));
     int n2;
-    char new_buf[MAXLINE];
-    /*web object*/
-    char value[MAX_OBJECT_SIZE];
-    /*reset*/
-    memset(new_buf, 0, MAXLINE);
-    /*reset*/
-    memset(value, 0, MAX_OBJECT_SIZE);
+    char *new_buf = client->fetch->chunk;
+    /*web object, only read up to the bytes received*/
+    char *value = client->fetch->value;
     /*index of valid data in the value array*/
     size_t current_index = 0;
 
+    ssize_t relayed = -1;
+    if (use_uring) {
+        relayed = uring_relay(client->server_fd, client->connfd, new_request,
+                              strlen(new_request), value, MAX_OBJECT_SIZE,
+                              relay_progress, client);
+    }
+    if (relayed >= 0) {
+        current_index = relayed;
+    } else if ((rio_writen(client->server_fd, new_request,
+                           strlen(new_request))) == -1) {
+        sio_printf("error\n");
+    }
+
     /*read data from server*/
-    while ((n2 = rio_readnb(&rio_server, new_buf, MAXLINE)) > 0) {
+    while (relayed < 0 &&
+           (n2 = rio_readnb(&client->fetch->rio, new_buf, MAXLINE)) > 0) {
+        relay_progress(client, current_index);
         /*if size of data is greater than max_object_size, skip copy data*/
-        if (current_index + n2 < MAX_OBJECT_SIZE) {
+        if (current_index + n2 <= MAX_OBJECT_SIZE) {
             memcpy(&value[current_index], new_buf, n2);
         }
         current_index += n2;
@@ -356,15 +834,50 @@ void process_request(client_info *client) {
         rio_writen(client->connfd, new_buf, n2);
     }
 
-    pthread_mutex_lock(&mutex);
-    /*add block if size less than the MAX_OBJECT_SIZE*/
+    timer_cancel(&client->timer);
+    /*never cache a response cut short by a timeout*/
+    if (client->timed_out >= 0) {
+        if (current_index == 0) {
+            clienterror(client->connfd, "504", "Gateway Timeout",
+                        "Proxy timed out waiting for the server");
+        }
+        parser_free(parser);
+        return;
+    }
+    log_access(key, current_index);
+
+    /*a response with Vary is cached under the request's header values*/
+    int varied = -1;
     if (current_index <= MAX_OBJECT_SIZE) {
-        add_block(key, value, current_index);
+        varied = vary_names(value, current_index, client->req->vary, MAXLINE);
+    }
+    if (varied > 0 &&
+        vary_key(key, client->req->vary, client->req->headers,
+                 client->req->nheaders, client->req->variant, MAXLINE) < 0) {
+        varied = -1;
     }
+    parser_free(parser);
 
-    pthread_mutex_unlock(&mutex);
-    /*close serve connect*/
-    close(server_fd);
+    /*add block if size less than the MAX_OBJECT_SIZE, and it may be shared*/
+    if (varied < 0) {
+        return;
+    }
+    if (varied > 0) {
+        insert_variant(key, client->req->vary, client->req->variant, value,
+                       current_index);
+        return;
+    }
+    /*build the block before locking, the lock only covers linking it in*/
+    block_t *block = block_init(key, value, current_index);
+    retired_t retired;
+    if (block == NULL) {
+        return;
+    }
+    site_lock(&mutex, add_site);
+    cache_insert(block, &retired);
+    site_unlock(&mutex, add_site);
+    /*evicted blocks are spilled and freed outside the lock*/
+    cache_release(&retired);
 }
 /**
  * The function creates a new thread to process a client request and then closes
@@ -383,13 +896,334 @@ void *thread(void *vargp) {
     pthread_detach(pthread_self());
     /*process request*/
     process_request(client);
+    PROBE2(request__done, client->uri, probe_since(client->accepted));
+    /*no timeout may touch the sockets once they are closed*/
+    timer_cancel(&client->timer);
+    /*close serve connect*/
+    if (client->server_fd >= 0) {
+        close(client->server_fd);
+    }
     /*close client*/
     close(client->connfd);
-    /*free client resource*/
-    free(client);
+    /*recycle client resource*/
+    pool_put(&fetch_pool, client->fetch);
+    pool_put(&request_pool, client->req);
+    pool_put(&client_pool, client);
+    /*let a draining main thread know this connection is done*/
+    pthread_mutex_lock(&conn_lock);
+    if (--active_connections == 0) {
+        pthread_cond_broadcast(&conn_done);
+    }
+    pthread_mutex_unlock(&conn_lock);
     return NULL;
 }
 
+/**
+ * The function counts a new connection as in flight and starts its thread.
+ *
+ * @param client The accepted client connection.
+ */
+void start_connection(client_info *client) {
+    pthread_attr_t attr;
+    pthread_t tid;
+    int rc;
+
+    client->server_fd = -1;
+    client->req = NULL;
+    client->fetch = NULL;
+    client->uri = NULL;
+    client->timed_out = -1;
+    timer_init(&client->timer);
+    client->accepted = probe_start(PROBE_ENABLED(parse__done) ||
+                                   PROBE_ENABLED(request__done));
+    PROBE1(accept, client->connfd);
+
+    pthread_mutex_lock(&conn_lock);
+    active_connections++;
+    pthread_mutex_unlock(&conn_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CONN_STACK_SIZE);
+    rc = pthread_create(&tid, &attr, thread, (void *)(client));
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        close(client->connfd);
+        pool_put(&client_pool, client);
+        pthread_mutex_lock(&conn_lock);
+        active_connections--;
+        pthread_mutex_unlock(&conn_lock);
+    }
+}
+
+/**
+ * The function makes the accept loop stop and start draining connections.
+ */
+void request_stop(void) {
+    char byte = 0;
+
+    stopping = 1;
+    if (write(wake_fds[1], &byte, 1) < 0) {
+        perror("write");
+    }
+}
+
+/**
+ * The function waits for in-flight connections to finish, giving up once the
+ * drain timeout has passed.
+ *
+ * @return the number of connections still running.
+ */
+int drain_connections(void) {
+    struct timespec deadline;
+    int remaining;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += drain_timeout;
+
+    pthread_mutex_lock(&conn_lock);
+    while (active_connections > 0) {
+        if (pthread_cond_timedwait(&conn_done, &conn_lock, &deadline) ==
+            ETIMEDOUT) {
+            break;
+        }
+    }
+    remaining = active_connections;
+    pthread_mutex_unlock(&conn_lock);
+    return remaining;
+}
+
+/**
+ * The function prints the proxy counters to stdout, and the lock profile when
+ * built with -DLOCKPROF.
+ */
+void print_stats(void) {
+    int phase;
+
+    printf("Timeouts:");
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        printf(" %s %lu", phase_names[phase],
+               __atomic_load_n(&timeout_counts[phase], __ATOMIC_RELAXED));
+    }
+    printf("\n");
+    lockprof_report(stdout);
+    fflush(stdout);
+}
+
+/**
+ * The function waits for termination signals and starts a graceful shutdown.
+ * A second signal exits immediately. SIGUSR1 prints the counters. If an
+ * interval is set, the snapshot is also saved periodically.
+ *
+ * @param vargp The set of blocked signals to wait for.
+ *
+ * @return a NULL pointer.
+ */
+void *signal_thread(void *vargp) {
+    sigset_t *set = (sigset_t *)vargp;
+    struct timespec interval = {snapshot_interval, 0};
+    int sig;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        if (snapshot_path != NULL && snapshot_interval > 0) {
+            sig = sigtimedwait(set, NULL, &interval);
+        } else {
+            sig = sigwaitinfo(set, NULL);
+        }
+        if (sig == SIGUSR1) {
+            print_stats();
+        } else if (sig == SIGTERM || sig == SIGINT) {
+            if (stopping) {
+                exit(1);
+            }
+            request_stop();
+        } else if (sig < 0 && errno == EAGAIN && !handed_off) {
+            /*periodic save; after a handoff the file is the successor's*/
+            save_snapshot();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The function runs before the listening socket is handed to a successor. It
+ * saves the snapshot the successor is about to load and stops spilling to the
+ * disk tier, whose files the successor recreates.
+ */
+void prepare_handoff(void) {
+    if (snapshot_path != NULL) {
+        save_snapshot();
+    }
+    site_lock(&mutex, handoff_site);
+    cache_set_evict_hook(NULL);
+    site_unlock(&mutex, handoff_site);
+    /*blocks evicted just before may still be on their way to the disk*/
+    cache_wait_released();
+}
+
+/**
+ * The function waits for a new proxy binary on the control socket, hands it
+ * the listening socket and then drains this process.
+ *
+ * @param vargp unused
+ *
+ * @return a NULL pointer.
+ */
+void *upgrade_thread(void *vargp) {
+    pthread_detach(pthread_self());
+    if (upgrade_handoff(control_fd, listenfds, nlisteners, prepare_handoff) ==
+        0) {
+        printf("Handed listening sockets to successor, draining\n");
+        handed_off = 1;
+        request_stop();
+    }
+    return NULL;
+}
+
+/**
+ * The function accepts connections on one listening socket until shutdown
+ * starts, and creates a new thread to handle each of them. With -U the
+ * io_uring engine does the accepting.
+ *
+ * @param listenfd The non-blocking listening socket.
+ */
+void accept_loop(int listenfd) {
+    if (use_uring && uring_accept_loop(listenfd, wake_fds[0], &stopping,
+                                       accept_connection) == 0) {
+        return;
+    }
+    while (!stopping) {
+        struct pollfd fds[2] = {{listenfd, POLLIN, 0},
+                                {wake_fds[0], POLLIN, 0}};
+
+        /* poll() will block until a client connects or shutdown starts */
+        if (poll(fds, 2, -1) < 0 || !(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        /* Take client info from the pool */
+        client_info *client = pool_get(&client_pool);
+        if (client == NULL) {
+            continue;
+        }
+
+        /* Initialize the length of the address */
+        client->addrlen = sizeof(client->addr);
+
+        client->connfd =
+            accept(listenfd, (SA *)&client->addr, &client->addrlen);
+        if (client->connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            pool_put(&client_pool, client);
+            continue;
+        }
+        /*create a new thread to heandle request*/
+        start_connection(client);
+    }
+}
+
+/**
+ * The function starts a connection accepted by the io_uring engine.
+ *
+ * @param connfd The client connection.
+ */
+void accept_connection(int connfd) {
+    client_info *client = pool_get(&client_pool);
+
+    if (client == NULL) {
+        close(connfd);
+        return;
+    }
+    /*the address is looked up by the connection thread*/
+    client->addrlen = 0;
+    client->connfd = connfd;
+    start_connection(client);
+}
+
+/**
+ * The function runs the accept loop of one extra listening socket.
+ *
+ * @param vargp The index of the acceptor and its listening socket.
+ *
+ * @return a NULL pointer.
+ */
+void *acceptor_thread(void *vargp) {
+    int index = (int)(intptr_t)vargp;
+    if (steer_acceptors) {
+        pin_acceptor(index);
+    }
+    accept_loop(listenfds[index]);
+    return NULL;
+}
+
+/**
+ * The function moves every object left in the snapshot into the memory cache
+ * after the proxy has started listening.
+ *
+ * @param vargp unused
+ *
+ * @return a NULL pointer.
+ */
+void *warm_thread(void *vargp) {
+    int restored = snapshot_restore(restore_block);
+    printf("Restored %d objects from snapshot\n", restored);
+    return NULL;
+}
+
+/**
+ * The function parses a byte count with an optional K, M or G suffix.
+ *
+ * @param arg The command line argument.
+ *
+ * @return the number of bytes, or 0 if the argument is malformed.
+ */
+size_t parse_size(const char *arg) {
+    char *end;
+    unsigned long long size = strtoull(arg, &end, 10);
+
+    switch (toupper((unsigned char)*end)) {
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+    return *end == '\0' ? (size_t)size : 0;
+}
+
+/**
+ * The function parses the phase deadlines, given in seconds as
+ * header:connect:first:idle. A zero disables the deadline of that phase.
+ *
+ * @param arg The command line argument.
+ *
+ * @return 0 on success, -1 if the argument is malformed.
+ */
+int parse_timeouts(const char *arg) {
+    unsigned seconds[PHASE_COUNT];
+    char end;
+    int phase;
+
+    if (sscanf(arg, "%u:%u:%u:%u%c", &seconds[PHASE_HEADER],
+               &seconds[PHASE_CONNECT], &seconds[PHASE_FIRST_BYTE],
+               &seconds[PHASE_IDLE], &end) != PHASE_COUNT) {
+        return -1;
+    }
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        phase_timeouts[phase] = seconds[phase] * 1000;
+    }
+    return 0;
+}
+
 /**
  * The main function is a server program that listens for incoming connections
  * on a specified port and creates a new thread to handle each client
@@ -397,52 +1231,240 @@ void *thread(void *vargp) {
  *
  * @param argc The argc parameter is an integer that represents the number of
  * command line arguments passed to the program.
- * @param argv port
+ * @param argv options and port
  *
  */
 int main(int argc, char **argv) {
 
-    int listenfd;
+    int opt;
+    const char *disk_dir = NULL;
+    size_t disk_budget = DCACHE_DEFAULT_BUDGET;
+    const char *control_path = NULL;
+    const char *log_path = NULL;
+    size_t capacity = MAX_CACHE_SIZE;
+    cache_policy_t policy = CACHE_LRU;
+    static sigset_t stop_signals;
+    pthread_t tid;
+    pthread_t acceptors[MAX_LISTENERS];
+    pthread_t warm_tid;
+    int i;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "d:D:s:S:g:u:a:At:m:r:q:Q:L:U")) != -1) {
+        switch (opt) {
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'D':
+            disk_budget = parse_size(optarg);
+            break;
+        case 's':
+            snapshot_path = optarg;
+            break;
+        case 'S':
+            snapshot_interval = atoi(optarg);
+            break;
+        case 'g':
+            drain_timeout = atoi(optarg);
+            break;
+        case 'u':
+            control_path = optarg;
+            break;
+        case 'a':
+            nlisteners = atoi(optarg);
+            break;
+        case 'A':
+            steer_acceptors = true;
+            break;
+        case 't':
+            if (parse_timeouts(optarg) < 0) {
+                argc = 0;
+            }
+            break;
+        case 'm':
+            capacity = parse_size(optarg);
+            break;
+        case 'r':
+            if (strcmp(optarg, "clock") == 0) {
+                policy = CACHE_CLOCK;
+            } else if (strcmp(optarg, "lru") != 0) {
+                argc = 0;
+            }
+            break;
+        case 'q':
+            if (strcmp(optarg, "sort") == 0) {
+                normalize_set_query(QUERY_SORT);
+            } else if (strcmp(optarg, "strip") == 0) {
+                normalize_set_query(QUERY_STRIP);
+            } else if (strcmp(optarg, "keep") != 0) {
+                argc = 0;
+            }
+            break;
+        case 'Q':
+            for (char *name = strtok(optarg, ","); name != NULL;
+                 name = strtok(NULL, ",")) {
+                if (normalize_drop_param(name) < 0) {
+                    argc = 0;
+                }
+            }
+            break;
+        case 'L':
+            log_path = optarg;
+            break;
+        case 'U':
+            use_uring = true;
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind != 1 || disk_budget == 0 || capacity == 0 ||
+        snapshot_interval < 0 ||
+        drain_timeout < 0 || nlisteners < 1 || nlisteners > MAX_LISTENERS) {
+        fprintf(stderr,
+                "usage: %s [-d diskdir] [-D diskbudget] [-s snapshot]"
+                " [-S seconds] [-g seconds] [-u controlpath]"
+                " [-a acceptors] [-A] [-t header:connect:first:idle]"
+                " [-m cachesize] [-r lru|clock] [-q keep|sort|strip]"
+                " [-Q param,...] [-L accesslog] [-U] <port>\n",
+                argv[0]);
         exit(1);
     }
     /*initialize cache*/
     cache_init();
+    cache_set_capacity(capacity);
+    cache_set_policy(policy);
+    if (log_path != NULL) {
+        access_log = fopen(log_path, "a");
+        if (access_log == NULL) {
+            fprintf(stderr, "Failed to open access log %s: %s\n", log_path,
+                    strerror(errno));
+            exit(1);
+        }
+    }
+    if (use_uring && uring_init() < 0) {
+        fprintf(stderr, "io_uring is not available, using blocking I/O\n");
+        use_uring = false;
+    }
     /*initialize lock*/
     pthread_mutex_init(&mutex, NULL);
     /*ignore SIGPIPE signal*/
     signal(SIGPIPE, SIG_IGN);
+    /*termination and report signals are handled by the signal thread only*/
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    if (pipe(wake_fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
 
-    // Open listening file descriptor
-    listenfd = open_listenfd(argv[1]);
-    if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
+    /*deadlines for every phase of a connection*/
+    if (timer_wheel_start() < 0) {
+        fprintf(stderr, "Failed to start timer thread\n");
         exit(1);
     }
-    /*server rountine*/
-    while (1) {
-        /* Allocate space on the stack for client info */
-        client_info *client = malloc(sizeof(client_info));
 
-        /* Initialize the length of the address */
-        client->addrlen = sizeof(client->addr);
+    /*take the listening sockets over from a running proxy if there is one*/
+    int taken = -1;
+    if (control_path != NULL) {
+        taken = upgrade_takeover(control_path, listenfds, MAX_LISTENERS);
+        if (taken > 0) {
+            printf("Took over %d listening sockets from running proxy\n",
+                   taken);
+            nlisteners = taken;
+            /*the old proxy's steering, or lack of it, came with them*/
+            if (steer_listeners(listenfds, taken, steer_acceptors) < 0) {
+                steer_acceptors = false;
+            }
+        }
+    }
+    /*map the snapshot, after a takeover it was just saved by the old proxy*/
+    if (snapshot_path != NULL) {
+        int count = snapshot_load(snapshot_path);
+        if (count >= 0) {
+            printf("Mapped snapshot with %d objects\n", count);
+        }
+    }
+    /*initialize the disk tier, evicted blocks spill into it*/
+    if (disk_dir != NULL) {
+        if (dcache_init(disk_dir, disk_budget) < 0) {
+            fprintf(stderr, "Failed to open disk cache: %s\n", disk_dir);
+            exit(1);
+        }
+        cache_set_evict_hook(dcache_put);
+    }
 
-        /* accept() will block until a client connects to the port */
-        client->connfd =
-            accept(listenfd, (SA *)&client->addr, &client->addrlen);
-        if (client->connfd < 0) {
-            perror("accept");
-            continue;
+    // Open listening file descriptors
+    if (taken <= 0 && open_listeners(argv[optind], listenfds, nlisteners,
+                                     steer_acceptors) < 0) {
+        fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
+        exit(1);
+    }
+    /*non-blocking, a process sharing the socket may win the accept race*/
+    for (i = 0; i < nlisteners; i++) {
+        fcntl(listenfds[i], F_SETFL, fcntl(listenfds[i], F_GETFL) | O_NONBLOCK);
+    }
+    if (control_path != NULL) {
+        control_fd = upgrade_listen(control_path);
+        if (control_fd >= 0) {
+            pthread_create(&tid, NULL, upgrade_thread, NULL);
         }
-        /*create a new thread to heandle request*/
-        pthread_t tid;
-        pthread_create(&tid, NULL, thread, (void *)(client));
+    }
+    pthread_create(&tid, NULL, signal_thread, &stop_signals);
+    if (snapshot_path != NULL) {
+        pthread_create(&warm_tid, NULL, warm_thread, NULL);
+    }
+    /*server rountine, one acceptor per listening socket*/
+    for (i = 1; i < nlisteners; i++) {
+        pthread_create(&acceptors[i], NULL, acceptor_thread,
+                       (void *)(intptr_t)i);
+    }
+    if (steer_acceptors) {
+        pin_acceptor(0);
+    }
+    accept_loop(listenfds[0]);
+    for (i = 1; i < nlisteners; i++) {
+        pthread_join(acceptors[i], NULL);
+    }
+
+    /*stop accepting; after a handoff the successor keeps the sockets open*/
+    for (i = 0; i < nlisteners; i++) {
+        close(listenfds[i]);
+    }
+    if (control_fd >= 0) {
+        shutdown(control_fd, SHUT_RDWR);
+        close(control_fd);
+        if (!handed_off) {
+            unlink(control_path);
+        }
+    }
+    int remaining = drain_connections();
+    /*the restore still writes to the cache and reads the mapping*/
+    if (snapshot_path != NULL) {
+        pthread_join(warm_tid, NULL);
+    }
+    print_stats();
+    if (snapshot_path != NULL && !handed_off) {
+        save_snapshot();
+    }
+    if (remaining > 0) {
+        fprintf(stderr, "Exiting with %d connections still open\n",
+                remaining);
+        exit(0);
     }
     /*clean resource*/
     cache_free();
+    if (!handed_off) {
+        dcache_free();
+    }
+    snapshot_free();
+    if (access_log != NULL) {
+        fclose(access_log);
+    }
     pthread_mutex_destroy(&mutex);
     return 0;
 }
@@ -5,6 +5,7 @@
 
 import datetime
 import errno
+import math
 import random
 import socket
 import subprocess
@@ -337,6 +338,7 @@ class Server:
         self.allOK = True
         self.disruption = Disruption.none
         self.sequenceNumber = 0
+        self.vary = None
 
         tryCount = 0
         portCount = 0
@@ -356,7 +358,7 @@ class Server:
                     self.sock = socket.socket(family, socktype)
                     self.sock.bind(sockaddr)
                     if not disabled:
-                        self.sock.listen(0)
+                        self.sock.listen(socket.SOMAXCONN)
                         if self.timeOut > 0:
                             self.sock.settimeout(self.timeOut)
                 except socket.error as ex:
@@ -493,6 +495,8 @@ class Server:
         if id != "" and uri is not None:
             lines.append("Content-Identifier: %s-%s\r\n" % (self.id, uri))
         lines.append("Sequence-Identifier: %s\r\n" % self.sequenceId())
+        if self.vary is not None:
+            lines.append("Vary: %s\r\n" % self.vary)
         lines.append("\r\n")
         return lines
 
@@ -777,6 +781,8 @@ class RequestGenerator:
         self.allOK = True
         self.disruption = Disruption.none
         self.instrumenter = InstrumentCache()
+        # Extra request headers, as (name, value), indexed by lowercased name
+        self.headers = {}
 
     def outMsg(self, msg):
         for line in msg.split("\n"):
@@ -791,6 +797,13 @@ class RequestGenerator:
     def scheduleDisruption(self, dis):
         self.disruption = dis
 
+    # Send header with later requests.  Value None stops sending it
+    def setHeader(self, name, value):
+        if value is None:
+            self.headers.pop(name.lower(), None)
+        else:
+            self.headers[name.lower()] = (name, value)
+
     # Make request for file.
     # If isFetch, then will do immediate response
     def request(self, event, url, isFetch, isPost):
@@ -863,6 +876,8 @@ class RequestGenerator:
         lines.append("Connection: close\r\n")
         lines.append("Proxy-Connection: close \r\n")
         lines.append("User-Agent: CMU/1.0 Iguana/20180704 PxyDrive/0.0.1\r\n")
+        for (name, value) in self.headers.values():
+            lines.append("%s: %s\r\n" % (name, value))
         lines.append("\r\n")
         event.sentHeaderLines = lines
         header = "".join(lines)
@@ -1022,6 +1037,189 @@ class RequestGenerator:
     def cacheStatistics(self):
         self.instrumenter.statistics(self.printer)
 
+# Open-loop load: requests are issued on a schedule of arrival times,
+# whether or not earlier requests have completed.  Latency is measured
+# from the scheduled arrival, not from when the request was actually
+# sent, so a stalled proxy shows up in the numbers instead of silently
+# slowing down the load (coordinated omission).
+class LoadGenerator:
+
+    id = ""
+    event = None
+    eventManager = None
+    printer = None
+    proxy = None   # indicated by (host, port)
+    urls = []
+    rate = 0.0     # Requests per second
+    duration = 0.0 # Seconds
+    poisson = False
+    thread = None
+    mutex = None
+    # Results
+    latencies = []   # Seconds, one per successful request
+    errors = 0
+    issued = 0
+    hits = 0         # Responses whose Sequence-Identifier was seen before
+    sequenceIds = {}
+    elapsed = 0.0
+    lastError = ""
+    outstanding = 0
+    scheduling = True
+    done = None
+
+    def __init__(self, event, eventManager, printer, proxy, urls, rate, duration, poisson = False):
+        self.id = event.id
+        self.event = event
+        self.eventManager = eventManager
+        self.printer = printer
+        self.proxy = proxy
+        self.urls = urls
+        self.rate = rate
+        self.duration = duration
+        self.poisson = poisson
+        self.mutex = threading.Lock()
+        self.latencies = []
+        self.errors = 0
+        self.issued = 0
+        self.hits = 0
+        self.sequenceIds = {}
+        self.elapsed = 0.0
+        self.lastError = ""
+        self.outstanding = 0
+        self.scheduling = True
+        self.done = threading.Event()
+        self.done.clear()
+
+    def start(self):
+        self.thread = threading.Thread(target = self.wrappedRun, name = "Load-%s" % self.id)
+        self.event.thread = self.thread
+        self.thread.start()
+
+    # Issue requests at their scheduled times, then wait for stragglers
+    def run(self):
+        # Same arrival schedule on every run, so runs can be compared
+        randomizer = random.Random(self.id)
+        startTime = time.time()
+        offset = 0.0
+        index = 0
+        while offset < self.duration and self.eventManager.running:
+            delay = startTime + offset - time.time()
+            if delay > 0:
+                time.sleep(delay)
+            url = self.urls[index % len(self.urls)]
+            self.mutex.acquire()
+            self.issued += 1
+            self.outstanding += 1
+            self.mutex.release()
+            t = threading.Thread(target = self.issue, args = (url, startTime + offset))
+            t.daemon = True
+            t.start()
+            index += 1
+            if self.poisson:
+                offset += randomizer.expovariate(self.rate)
+            else:
+                offset += 1.0 / self.rate
+        self.mutex.acquire()
+        self.scheduling = False
+        if self.outstanding == 0:
+            self.done.set()
+        self.mutex.release()
+        self.done.wait()
+        self.elapsed = time.time() - startTime
+        if self.errors > 0:
+            self.eventManager.changeTag(self.event, "error", "%d of %d requests failed (%s)" % (self.errors, self.issued, self.lastError))
+        else:
+            self.eventManager.changeTag(self.event, "ok", "")
+
+    def wrappedRun(self):
+        try:
+            self.run()
+        except Exception as e:
+            self.printer.panic("Load generator %s" % self.id, e)
+            self.eventManager.changeTag(self.event, "error", str(e))
+        self.eventManager.addCompleted(self.event)
+
+    # Perform one request.  Returns (ok, sequenceId, reason)
+    def fetch(self, url):
+        host, port, uri = parseURL(url)[1:]
+        sock = socket.create_connection(self.proxy, 10.0)
+        try:
+            sock.sendall("GET %s HTTP/1.0\r\n" % url +
+                         "Host: %s:%d\r\n" % (host, port) +
+                         "Response: Immediate\r\n" +
+                         "Connection: close\r\n" +
+                         "Proxy-Connection: close\r\n" +
+                         "User-Agent: CMU/1.0 Iguana/20180704 PxyDrive/0.0.1\r\n" +
+                         "\r\n")
+            chunks = []
+            while True:
+                buf = sock.recv(65536)
+                if len(buf) == 0:
+                    break
+                chunks.append(buf)
+        finally:
+            sock.close()
+        data = "".join(chunks)
+        pos = data.find("\r\n\r\n")
+        if pos < 0:
+            return (False, None, "Incomplete response header")
+        lines = data[:pos].split("\r\n")
+        fields = lines[0].split(None, 2)
+        if len(fields) < 2 or fields[1] != "200":
+            return (False, None, "Response status line '%s'" % lines[0])
+        length = -1
+        sequenceId = None
+        for line in lines[1:]:
+            name, sep, value = line.partition(":")
+            name = name.strip().lower()
+            if name == "content-length":
+                length = int(value)
+            elif name == "sequence-identifier":
+                sequenceId = value.strip()
+        if length != len(data) - pos - 4:
+            return (False, None, "Expected %d bytes, got %d" % (length, len(data) - pos - 4))
+        return (True, sequenceId, "")
+
+    def issue(self, url, scheduled):
+        try:
+            (ok, sequenceId, reason) = self.fetch(url)
+        except Exception as ex:
+            (ok, sequenceId, reason) = (False, None, str(ex))
+        latency = time.time() - scheduled
+        self.mutex.acquire()
+        if ok:
+            self.latencies.append(latency)
+            if sequenceId is not None:
+                key = (url, sequenceId)
+                if key in self.sequenceIds:
+                    self.hits += 1
+                self.sequenceIds[key] = True
+        else:
+            self.errors += 1
+            self.lastError = reason
+        self.outstanding -= 1
+        if self.outstanding == 0 and not self.scheduling:
+            self.done.set()
+        self.mutex.release()
+
+    # Latency in seconds below which pct percent of the requests completed
+    def percentile(self, pct):
+        ls = sorted(self.latencies)
+        if len(ls) == 0:
+            return 0.0
+        index = int(math.ceil(pct / 100.0 * len(ls))) - 1
+        return ls[max(0, min(index, len(ls) - 1))]
+
+    def report(self):
+        count = len(self.latencies)
+        rate = count / self.elapsed if self.elapsed > 0 else 0.0
+        hitRate = 100.0 * self.hits / count if count > 0 else 0.0
+        self.printer.outMsg("Load %s: %d requests, %d errors, %.1f requests/s, %d (%.1f%%) hits" % (self.id, self.issued, self.errors, rate, self.hits, hitRate))
+        marks = [50, 90, 99, 99.9]
+        values = " ".join(["p%g %.2f" % (m, 1000.0 * self.percentile(m)) for m in marks])
+        maximum = 1000.0 * max(self.latencies) if count > 0 else 0.0
+        self.printer.outMsg("Load %s latency (ms): %s max %.2f" % (self.id, values, maximum))
+
 # Heartbeat event
 class Beat:
     timeStamp = None
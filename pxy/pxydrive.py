@@ -83,6 +83,8 @@ class Driver:
     haveProxy = False
     proxyProcess = None
     getId = 0
+    # Load generators, indexed by id
+    loads = {}
 
 
     # Mapping from id to event.  Used to implement wait *
@@ -114,6 +116,7 @@ class Driver:
         self.proxyProcess = None
         self.activeEvents = {}
         self.getId = 0
+        self.loads = {}
 
         self.console.addOption("strict", self.strict, "Set level of strictness on HTTP message formatting (0-4)")
         self.console.addOption("timing", self.checkTiming, "Insert random delays into synchronization operations")
@@ -140,6 +143,10 @@ class Driver:
         self.console.addCommand("trace", self.doTrace,         "ID+",   "Trace histories of requests")
         self.console.addCommand("signal", self.doSignal,       "[SIGNO]", "Send signal number SIGNO to process.  Default = 13 (SIGPIPE)")
         self.console.addCommand("disrupt", self.doDisrupt,     "(request|response) [SID]", "Schedule disruption of request or response by client [or server SID]")
+        self.console.addCommand("load", self.doLoad,          "LID RATE MS (fixed|poisson) FILE+ SID", "Issue requests for FILEs from server SID at RATE per second for MS milliseconds, without waiting for responses")
+        self.console.addCommand("latency", self.doLatency,    "LID [PCT MS]", "Print latency percentiles of load LID [and require percentile PCT to be at most MS milliseconds]")
+        self.console.addCommand("header", self.doHeader,      "NAME [VALUE]", "Send header NAME with later requests [or stop sending it]")
+        self.console.addCommand("vary", self.doVary,          "SID NAME", "Make server SID send 'Vary: NAME' with its responses")
         self.console.addCommand("wait", self.doWait,          "* | ID+", "Wait until all or listed pending requests, fetches, and responses have completed")
 
 
@@ -285,6 +292,74 @@ class Driver:
         return self.doRequestOrFetch(args, True, True)
 
 
+    def doLoad(self, args):
+        if len(args) < 6:
+            self.console.errMsg("Load command requires at least six arguments")
+            return False
+        (status, msg) = self.checkProxy()
+        if not status:
+            self.console.errMsg("Cannot execute load. %s" % msg)
+            return False
+        lid = args[0]
+        try:
+            rate = float(args[1])
+            duration = float(args[2]) / 1000.0
+        except:
+            self.console.errMsg("Invalid rate '%s' or duration '%s'" % (args[1], args[2]))
+            return False
+        if rate <= 0 or duration <= 0:
+            self.console.errMsg("Rate and duration must be positive")
+            return False
+        if args[3] not in ["fixed", "poisson"]:
+            self.console.errMsg("Arrival process must be 'fixed' or 'poisson'")
+            return False
+        sid = args[-1]
+        if sid not in self.servers:
+            self.console.errMsg("Invalid server name %s" % sid)
+            return False
+        server = self.servers[sid]
+        urls = [server.generateURL(file) for file in args[4:-1]]
+        try:
+            event = self.eventManager.addRequestEvent(lid, server = sid, isFetch = True)
+        except events.EventException as ex:
+            self.console.errMsg("Couldn't generate load event %s (%s)" % (lid, ex))
+            return False
+        load = agents.LoadGenerator(event, self.eventManager, self.console, self.requestManager.proxy,
+                                    urls, rate, duration, poisson = args[3] == "poisson")
+        self.loads[lid] = load
+        self.activeEvents[lid] = event
+        self.console.outMsg("Load %s: %s arrivals at %g requests/s for %g ms" % (lid, args[3], rate, duration * 1000.0))
+        load.start()
+        return True
+
+    def doLatency(self, args):
+        if len(args) != 1 and len(args) != 3:
+            self.console.errMsg("Latency command requires one or three arguments")
+            return False
+        lid = args[0]
+        if lid not in self.loads:
+            self.console.errMsg("Invalid load ID '%s'" % lid)
+            return False
+        load = self.loads[lid]
+        if not load.done.isSet():
+            self.console.errMsg("Load %s has not completed.  Use wait first" % lid)
+            return False
+        load.report()
+        if len(args) == 1:
+            return True
+        try:
+            pct = float(args[1])
+            limit = float(args[2]) * self.stretch.getInteger()/100.0
+        except:
+            self.console.errMsg("Invalid percentile '%s' or limit '%s'" % (args[1], args[2]))
+            return False
+        value = 1000.0 * load.percentile(pct)
+        if len(load.latencies) == 0 or value > limit:
+            self.console.errMsg("Load %s: p%g latency %.2f ms exceeds %.2f ms" % (lid, pct, value, limit))
+            return False
+        self.console.outMsg("Load %s: p%g latency %.2f ms within %.2f ms" % (lid, pct, value, limit))
+        return True
+
     def doRespond(self, args):
         (status, msg) = self.checkProxy()
         if not status:
@@ -692,6 +767,25 @@ class Driver:
             self.requestManager.scheduleDisruption(dis)
         return True
 
+    def doHeader(self, args):
+        if len(args) < 1:
+            self.console.errMsg("Header command requires a header name")
+            return False
+        value = " ".join(args[1:]) if len(args) > 1 else None
+        self.requestManager.setHeader(args[0], value)
+        return True
+
+    def doVary(self, args):
+        if len(args) != 2:
+            self.console.errMsg("Vary command requires two arguments")
+            return False
+        sid = args[0]
+        if sid not in self.servers:
+            self.console.errMsg("Invalid server name %s" % sid)
+            return False
+        self.servers[sid].vary = args[1]
+        return True
+
 def run(name, args):
     global wrapperLibrary
     quietMode = False
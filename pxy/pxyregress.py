@@ -14,16 +14,19 @@ import threading
 import datetime
 
 def usage(name):
-    print "Usage: %s [-h] -p PROXY [-s [ABCD]+] [-a ALIMIT] [-c (0-4)] [-t SECS] [(-l|-L) FILE] [-d STRETCH]" % name
+    print "Usage: %s [-h] -p PROXY [-s [ABCDP]+] [-a ALIMIT] [-c (0-4)] [-t SECS] [(-l|-L) FILE] [-d STRETCH] [-b FILE] [-r PCT] [-B]" % name
     print "  -h           Print this message"
     print "  -p PROXY     Run specified proxy"
-    print "  -s [ABCDE]+  Run specified series of tests (any subset of A, B, C, and D)"
+    print "  -s [ABCDP]+  Run specified series of tests (any subset of A, B, C, D, and P)"
     print "  -a ALIMIT    Set limit on number of failing tests before abort"
     print "  -t SECS      Set upper time limit for any given test (Value 0 ==> run indefinitely)"
     print "  -c CHECK     Set level of checking options (0-3)"
     print "  -l FILE      Copy results to FILE"
     print "  -L FILE      Copy results AND individual log files for failed tests to FILE"
     print "  -d STRETCH   Set stretch value for all delays"
+    print "  -b FILE      Compare P series results against baselines in FILE"
+    print "  -r PCT       Flag P series results more than PCT percent worse than baseline"
+    print "  -B           Record P series results as baselines, keeping the worst of repeated recordings"
     sys.exit(0)
 
 # Parameters
@@ -42,6 +45,15 @@ checkLevel = 0
 logFile = None
 stretch = None
 abortLimit = 3
+# Performance baselines for the P series
+baselinePath = None
+baselineFile = "perf-baselines.txt"
+tolerance = 50.0
+# Slack added to latency limits, so that tiny baselines are not all noise
+latencySlack = 5.0
+recordBaselines = False
+# Output of the most recent test run
+lastOutput = ""
 
 def findProgram():
     fields = homePathFields + [driverProgram]
@@ -53,6 +65,11 @@ def findTests():
     path = '/'.join(fields)
     return path
 
+def findBaselines():
+    if baselinePath is not None:
+        return baselinePath
+    return findTests() + "/" + baselineFile
+
 def wrapPath(path):
     return "'" + path + "'"    
 
@@ -120,6 +137,8 @@ def findLogPath(testPath):
 
 # Run test.  Return (True, "summary") for success (False, reason) for failure
 def runTest(proxyPath, testPath, generateLog = True, limit = None):
+    global lastOutput
+    lastOutput = ""
     if not os.path.exists(proxyPath):
         return (False, "File %s does not exist" % proxyPath)
     if not os.path.exists(testPath):
@@ -153,6 +172,7 @@ def runTest(proxyPath, testPath, generateLog = True, limit = None):
     if killer.timedOut:
         reason = "Timed out"
         return (False, reason)
+    lastOutput = stdoutdata
 
     if process.returncode != 0:
         reason = "driver exited with return code %d" % process.returncode
@@ -174,6 +194,97 @@ def runTest(proxyPath, testPath, generateLog = True, limit = None):
     reason = lastLine
     return (ok, reason)
         
+# Get test name from path
+def testName(testPath):
+    fname = testPath.split("/")[-1]
+    return ".".join(fname.split(".")[0:-1])
+
+# Extract load results from pxydrive output.
+# Return dictionary mapping load ID to (requests/s, p50 ms, p99 ms)
+def parseLoads(output):
+    rates = {}
+    latencies = {}
+    for line in output.split('\n'):
+        fields = line.split()
+        if len(fields) < 3 or fields[0] != "Load":
+            continue
+        lid = fields[1].rstrip(':')
+        try:
+            if "requests/s," in fields:
+                rates[lid] = float(fields[fields.index("requests/s,") - 1])
+            elif fields[2] == "latency" and "p50" in fields and "p99" in fields:
+                latencies[lid] = (float(fields[fields.index("p50") + 1]),
+                                  float(fields[fields.index("p99") + 1]))
+        except ValueError:
+            continue
+    results = {}
+    for lid in rates:
+        if lid in latencies:
+            results[lid] = (rates[lid],) + latencies[lid]
+    return results
+
+# Read baselines.  Return dictionary mapping (test, load ID) to (p50 ms, p99 ms)
+def readBaselines():
+    baselines = {}
+    try:
+        bfile = open(findBaselines())
+    except:
+        return baselines
+    for line in bfile:
+        fields = line.split()
+        if len(fields) != 4 or fields[0][0] == '#':
+            continue
+        try:
+            baselines[(fields[0], fields[1])] = (float(fields[2]), float(fields[3]))
+        except ValueError:
+            continue
+    bfile.close()
+    return baselines
+
+def writeBaselines(baselines):
+    try:
+        bfile = open(findBaselines(), 'w')
+    except Exception as e:
+        outMsg("ERROR: Couldn't write baselines to %s (%s)" % (findBaselines(), str(e)))
+        return False
+    bfile.write("# Performance baselines for the P series, recorded with pxyregress.py -B\n")
+    bfile.write("# test load p50(ms) p99(ms)\n")
+    for key in sorted(baselines.keys()):
+        (p50, p99) = baselines[key]
+        bfile.write("%s %s %.2f %.2f\n" % (key[0], key[1], p50, p99))
+    bfile.close()
+    return True
+
+# Compare the loads of a test with its baselines.  Return (ok, reason)
+# Loads are open-loop, so requests/s follows the offered rate and is only
+# reported; a slower proxy shows up in the latencies, and failed requests
+# already fail the test's check command.
+def checkBaselines(testPath, results, baselines):
+    name = testName(testPath)
+    if len(results) == 0:
+        return (False, "No load results in output")
+    problems = []
+    for lid in sorted(results.keys()):
+        (rate, p50, p99) = results[lid]
+        if recordBaselines:
+            # Several recordings capture the run to run noise
+            if (name, lid) in baselines:
+                (bp50, bp99) = baselines[(name, lid)]
+                (p50, p99) = (max(p50, bp50), max(p99, bp99))
+            baselines[(name, lid)] = (p50, p99)
+            continue
+        if (name, lid) not in baselines:
+            continue
+        (bp50, bp99) = baselines[(name, lid)]
+        if p50 > bp50 * (1.0 + tolerance / 100.0) + latencySlack:
+            problems.append("%s p50 %.2f ms above baseline %.2f ms" % (lid, p50, bp50))
+        if p99 > bp99 * (1.0 + tolerance / 100.0) + latencySlack:
+            problems.append("%s p99 %.2f ms above baseline %.2f ms" % (lid, p99, bp99))
+    summary = ", ".join(["%s %.1f requests/s p50 %.2f ms p99 %.2f ms" % ((lid,) + results[lid]) for lid in sorted(results.keys())])
+    if len(problems) > 0:
+        return (False, "Performance regression: " + "; ".join(problems))
+    return (True, summary)
+
 # Return list with elements of form (series, pathList)
 def chooseTests(series):
     testSets = []
@@ -221,13 +332,16 @@ def run(name, args):
     global stretch
     global logFile
     global abortLimit
+    global baselinePath
+    global tolerance
+    global recordBaselines
     limit = 60
     proxy = None
     series = "ABCD"
     generateLog = True
     superLog = False
     try:
-        optlist, args = getopt.getopt(args, "hp:s:a:t:c:l:L:d:")
+        optlist, args = getopt.getopt(args, "hp:s:a:t:c:l:L:d:b:r:B")
     except getopt.GetoptError as e:
         print "Command-line error (%s)" % str(e)
         usage(name)
@@ -271,6 +385,16 @@ def run(name, args):
             except:
                 outMsg("Invalid value of stretch '%s'.  Must be integer (100 = unstretched)" % val)
                 sys.exit(1)
+        elif opt == '-b':
+            baselinePath = val
+        elif opt == '-r':
+            try:
+                tolerance = float(val)
+            except:
+                outMsg("Invalid tolerance '%s'" % val)
+                sys.exit(1)
+        elif opt == '-B':
+            recordBaselines = True
                 
     if proxy is None:
         outMsg("ERROR: No proxy specified")
@@ -283,6 +407,7 @@ def run(name, args):
     failure = 0
 
     badTests = []
+    baselines = readBaselines()
 
     tstart = datetime.datetime.now()
 
@@ -293,6 +418,8 @@ def run(name, args):
                 (ok, reason) = runTest(proxy, t, generateLog, limit)
                 if ok or reason != portReason:
                     break
+            if ok and series == 'P':
+                (ok, reason) = checkBaselines(t, parseLoads(lastOutput), baselines)
             if ok:
                 success += 1
             else:
@@ -330,6 +457,9 @@ def run(name, args):
     else:
         outMsg("No tests performed")
 
+    if recordBaselines and writeBaselines(baselines):
+        outMsg("Baselines recorded in %s" % findBaselines())
+
     if superLog:
         for t in badTests:
             fullLog(findLogPath(t))
@@ -0,0 +1,89 @@
+/**
+ * @file rcu.c
+ * @brief Counter-based read-copy-update
+ *
+ * Each reader increments the counter of the current epoch's parity in its
+ * slot, and decrements the same counter when it leaves. rcu_synchronize()
+ * first waits for readers still counted under the other parity, which may
+ * have read the epoch long ago, then flips the epoch so new readers count
+ * under the other parity, and waits for the old parity to drain. A reader
+ * that started counting after the flip reads pointers after the writer's
+ * unlink, so it cannot see the unlinked object.
+ */
+
+#include "rcu.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+/*reader counters of one slot, in a cache line of their own*/
+typedef union {
+    unsigned long count[2]; /*readers inside, per epoch parity*/
+    char pad[64];           /*keeps slots out of each other's lines*/
+} rcu_slot_t;
+
+static rcu_slot_t slots[RCU_SLOTS];
+static unsigned long epoch = 0;
+static unsigned next_slot = 0;
+/*slot of this thread, RCU_SLOTS until it has one*/
+static __thread unsigned my_slot = RCU_SLOTS;
+/*serializes grace periods*/
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The function enters a read-side critical section.
+ *
+ * @return the epoch parity to pass to rcu_read_unlock().
+ */
+int rcu_read_lock(void) {
+    int parity;
+
+    if (my_slot == RCU_SLOTS) {
+        my_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) %
+                  RCU_SLOTS;
+    }
+    parity = __atomic_load_n(&epoch, __ATOMIC_RELAXED) & 1;
+    __atomic_fetch_add(&slots[my_slot].count[parity], 1, __ATOMIC_RELAXED);
+    /*the count must be visible before any pointer is read*/
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return parity;
+}
+
+/**
+ * The function leaves a read-side critical section. Pointers read inside it
+ * must not be used afterwards.
+ *
+ * @param parity The value returned by rcu_read_lock().
+ */
+void rcu_read_unlock(int parity) {
+    __atomic_fetch_sub(&slots[my_slot].count[parity], 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * wait_readers - wait until no reader is counted under a parity
+ */
+static void wait_readers(int parity) {
+    for (int i = 0; i < RCU_SLOTS; i++) {
+        while (__atomic_load_n(&slots[i].count[parity], __ATOMIC_ACQUIRE) !=
+               0) {
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * The function waits until every read-side critical section that started
+ * before the call has ended.
+ */
+void rcu_synchronize(void) {
+    int parity;
+
+    pthread_mutex_lock(&sync_lock);
+    /*the caller's unlink must be visible before any count is read*/
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    parity = __atomic_load_n(&epoch, __ATOMIC_RELAXED) & 1;
+    wait_readers(parity ^ 1);
+    __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+    wait_readers(parity);
+    pthread_mutex_unlock(&sync_lock);
+}
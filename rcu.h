@@ -0,0 +1,44 @@
+/**
+ * @file rcu.h
+ * @brief Definitions and interfaces for rcu.c
+ *
+ * Read-copy-update for structures that are read far more often than they
+ * change. Readers bracket their accesses with rcu_read_lock() and
+ * rcu_read_unlock(), which never wait and only touch a counter in their own
+ * cache line. A writer, serialized by its own lock, unlinks an object so that
+ * new readers cannot find it, then calls rcu_synchronize(), which returns once
+ * every reader that might still hold a pointer to it has finished. After that
+ * the object can be freed.
+ *
+ * Read-side critical sections must be short and must not block: a writer
+ * waits for all of them.
+ */
+
+#ifndef RCU_H
+#define RCU_H
+
+/* Reader counters, threads share them round robin */
+#define RCU_SLOTS 64
+
+/**
+ * The function enters a read-side critical section.
+ *
+ * @return the epoch parity to pass to rcu_read_unlock().
+ */
+int rcu_read_lock(void);
+
+/**
+ * The function leaves a read-side critical section. Pointers read inside it
+ * must not be used afterwards.
+ *
+ * @param parity The value returned by rcu_read_lock().
+ */
+void rcu_read_unlock(int parity);
+
+/**
+ * The function waits until every read-side critical section that started
+ * before the call has ended.
+ */
+void rcu_synchronize(void);
+
+#endif /* RCU_H */
@@ -0,0 +1,326 @@
+/**
+ * @file snapshot.c
+ * @brief Save the memory cache to a mappable file and serve it after restart
+ *
+ * File layout, in host byte order:
+ *
+ *   snap_header_t                 magic, version, slot count, object count
+ *   snap_slot_t[nslots]           open addressing table, linear probing
+ *   key and object bytes          referenced by offset from the slots
+ *
+ * Loading only maps the file and checks the header, so a restarted proxy can
+ * serve warm hits as soon as it is listening. Objects are copied into the
+ * memory cache when they are first requested, or by snapshot_restore() in
+ * the background, whichever claims them first.
+ */
+
+#include "snapshot.h"
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAP_MAGIC 0x53595850 /* "PXYS" */
+#define SNAP_VERSION 1
+
+typedef struct {
+    uint32_t magic;   /*SNAP_MAGIC*/
+    uint32_t version; /*SNAP_VERSION*/
+    uint32_t nslots;  /*slot table size, a power of two*/
+    uint32_t count;   /*number of objects*/
+    uint64_t size;    /*size of the whole file*/
+} snap_header_t;
+
+typedef struct {
+    uint64_t hash;      /*key hash, 0 marks an empty slot*/
+    uint64_t key_off;   /*file offset of the key*/
+    uint64_t value_off; /*file offset of the web object*/
+    uint32_t key_len;   /*length of the key, no terminator*/
+    uint32_t value_len; /*length of the web object*/
+} snap_slot_t;
+
+static const char *map = NULL;
+static size_t map_size = 0;
+static const snap_slot_t *slots = NULL;
+static uint32_t nslots = 0;
+static unsigned char *consumed = NULL;
+
+/*
+ * hash_key - 64-bit FNV-1a hash, never 0 so that 0 can mark empty slots
+ */
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h == 0 ? 1 : h;
+}
+
+/*
+ * collect - cache_walk visitor appending each web object to the list
+ */
+static void collect(block_t *block, void *arg) {
+    snapshot_objects_t *c = arg;
+    /*snapshots are looked up by uri, variants and their markers stay out*/
+    if (block->kind != BLOCK_OBJECT) {
+        return;
+    }
+    if (c->count == c->capacity) {
+        size_t capacity = c->capacity ? c->capacity * 2 : 64;
+        block_t **blocks = realloc(c->blocks, capacity * sizeof(block_t *));
+        if (blocks == NULL) {
+            return;
+        }
+        c->blocks = blocks;
+        c->capacity = capacity;
+    }
+    /*a private copy, the block itself may be evicted during the write*/
+    block_t *copy = block_init(block->key, block->value, block->value_length);
+    if (copy != NULL) {
+        c->blocks[c->count++] = copy;
+    }
+}
+
+/**
+ * The function copies every web object of the memory cache for
+ * snapshot_save(). The caller must hold the cache lock.
+ *
+ * @param objects Receives the objects, initialized to {NULL, 0, 0}.
+ */
+void snapshot_collect(snapshot_objects_t *objects) {
+    cache_walk(collect, objects);
+}
+
+/**
+ * The function writes copied web objects to a snapshot file and frees them.
+ * The file is written under a temporary name and renamed into place, so a
+ * crash never leaves a torn snapshot behind. The cache lock is not needed.
+ *
+ * @param path The snapshot file.
+ * @param objects The objects from snapshot_collect().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int snapshot_save(const char *path, snapshot_objects_t *objects) {
+    char tmp[MAXLINE];
+    snapshot_objects_t c = *objects;
+    snap_header_t header;
+    snap_slot_t *table;
+    uint64_t offset;
+    size_t i;
+    int fd, rc = -1;
+
+    header.magic = SNAP_MAGIC;
+    header.version = SNAP_VERSION;
+    header.count = c.count;
+    /*keep the table at most half full*/
+    for (header.nslots = 16; header.nslots < 2 * c.count; header.nslots *= 2)
+        ;
+
+    table = calloc(header.nslots, sizeof(snap_slot_t));
+    if (table == NULL) {
+        goto done;
+    }
+    offset = sizeof(header) + (uint64_t)header.nslots * sizeof(snap_slot_t);
+    for (i = 0; i < c.count; i++) {
+        block_t *block = c.blocks[i];
+        size_t key_len = block->key_length;
+        uint64_t h = hash_key(block->key, key_len);
+        uint32_t s = h & (header.nslots - 1);
+        while (table[s].hash != 0) {
+            s = (s + 1) & (header.nslots - 1);
+        }
+        table[s].hash = h;
+        table[s].key_off = offset;
+        table[s].key_len = key_len;
+        table[s].value_off = offset + key_len;
+        table[s].value_len = block->value_length;
+        offset += key_len + block->value_length;
+    }
+    header.size = offset;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "snapshot: open %s failed: %s\n", tmp,
+                strerror(errno));
+        goto done;
+    }
+    if (rio_writen(fd, &header, sizeof(header)) < 0 ||
+        rio_writen(fd, table, header.nslots * sizeof(snap_slot_t)) < 0) {
+        goto write_error;
+    }
+    /*data goes out in the order the offsets were handed out*/
+    for (i = 0; i < c.count; i++) {
+        block_t *block = c.blocks[i];
+        if (rio_writen(fd, block->key, block->key_length) < 0 ||
+            rio_writen(fd, block->value, block->value_length) < 0) {
+            goto write_error;
+        }
+    }
+    if (close(fd) == 0 && rename(tmp, path) == 0) {
+        rc = 0;
+    } else {
+        unlink(tmp);
+    }
+    goto done;
+
+write_error:
+    fprintf(stderr, "snapshot: write %s failed: %s\n", tmp, strerror(errno));
+    close(fd);
+    unlink(tmp);
+done:
+    free(table);
+    for (i = 0; i < c.count; i++) {
+        free(c.blocks[i]);
+    }
+    free(c.blocks);
+    return rc;
+}
+
+/**
+ * The function maps a snapshot file left by a previous run. No index is built
+ * up front; snapshot_find() probes the mapped slot table directly.
+ *
+ * @param path The snapshot file.
+ *
+ * @return the number of objects in the snapshot, or -1 if there is no usable
+ * snapshot.
+ */
+int snapshot_load(const char *path) {
+    struct stat st;
+    const snap_header_t *header;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snap_header_t)) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        return -1;
+    }
+    map_size = st.st_size;
+
+    header = (const snap_header_t *)map;
+    if (header->magic != SNAP_MAGIC || header->version != SNAP_VERSION ||
+        header->size != map_size || header->nslots == 0 ||
+        (header->nslots & (header->nslots - 1)) != 0 ||
+        sizeof(*header) + (uint64_t)header->nslots * sizeof(snap_slot_t) >
+            map_size) {
+        fprintf(stderr, "snapshot: %s is not a usable snapshot\n", path);
+        snapshot_free();
+        return -1;
+    }
+    consumed = calloc(header->nslots, 1);
+    if (consumed == NULL) {
+        snapshot_free();
+        return -1;
+    }
+    nslots = header->nslots;
+    slots = (const snap_slot_t *)(map + sizeof(*header));
+    return header->count;
+}
+
+/**
+ * The function looks up a key in the mapped snapshot. Each object is handed
+ * out once, after which it is expected to live in the memory cache.
+ *
+ * @param key The uri used as the cache key.
+ * @param value Set to the web object inside the mapping.
+ * @param length Set to the length of the web object.
+ *
+ * @return true if the key was found.
+ */
+bool snapshot_find(const char *key, const char **value, size_t *length) {
+    if (slots == NULL) {
+        return false;
+    }
+    size_t key_len = strlen(key);
+    uint64_t h = hash_key(key, key_len);
+    uint32_t s = h & (nslots - 1);
+
+    /*a corrupt table may have no empty slot, so probe each slot once*/
+    for (uint32_t probes = 0; probes < nslots && slots[s].hash != 0;
+         probes++, s = (s + 1) & (nslots - 1)) {
+        const snap_slot_t *slot = &slots[s];
+        if (slot->hash != h || slot->key_len != key_len ||
+            slot->key_off + key_len > map_size ||
+            slot->value_off + slot->value_len > map_size ||
+            memcmp(map + slot->key_off, key, key_len) != 0) {
+            continue;
+        }
+        /*claim the object so only one thread restores it*/
+        if (__atomic_exchange_n(&consumed[s], 1, __ATOMIC_ACQ_REL)) {
+            return false;
+        }
+        *value = map + slot->value_off;
+        *length = slot->value_len;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * The function hands every object not yet claimed by snapshot_find() to a
+ * restore callback, so the whole snapshot can be moved into the memory cache
+ * in the background after startup.
+ *
+ * @param restore The function receiving each key and web object.
+ *
+ * @return the number of objects restored.
+ */
+int snapshot_restore(void (*restore)(char key[], const char *value,
+                                     size_t length)) {
+    char key[MAXLINE];
+    uint32_t s;
+    int restored = 0;
+
+    for (s = 0; s < nslots; s++) {
+        const snap_slot_t *slot = &slots[s];
+        if (slot->hash == 0 || slot->key_len >= MAXLINE ||
+            slot->key_off + slot->key_len > map_size ||
+            slot->value_off + slot->value_len > map_size ||
+            slot->value_len > MAX_OBJECT_SIZE) {
+            continue;
+        }
+        if (__atomic_exchange_n(&consumed[s], 1, __ATOMIC_ACQ_REL)) {
+            continue;
+        }
+        memcpy(key, map + slot->key_off, slot->key_len);
+        key[slot->key_len] = '\0';
+        restore(key, map + slot->value_off, slot->value_len);
+        restored++;
+    }
+    return restored;
+}
+
+/**
+ * @brief clean snapshot resource
+ * The function `snapshot_free` unmaps the snapshot file.
+ */
+void snapshot_free(void) {
+    if (map != NULL) {
+        munmap((void *)map, map_size);
+    }
+    free(consumed);
+    map = NULL;
+    map_size = 0;
+    slots = NULL;
+    nslots = 0;
+    consumed = NULL;
+}
@@ -0,0 +1,84 @@
+/**
+ * @file snapshot.h
+ * @brief Definitions and interfaces for snapshot.c
+ *
+ * A snapshot is a copy of the memory cache laid out so that it can be mapped
+ * and probed in place: a header, an open addressing slot table, and then the
+ * keys and web objects the slots point at.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*copies of the cache's web objects, to be written to a snapshot*/
+typedef struct {
+    struct Block **blocks; /*the copies, most recently added first*/
+    size_t count;          /*number of blocks*/
+    size_t capacity;       /*size of blocks*/
+} snapshot_objects_t;
+
+/**
+ * The function copies every web object of the memory cache for
+ * snapshot_save(). The caller must hold the cache lock.
+ *
+ * @param objects Receives the objects, initialized to {NULL, 0, 0}.
+ */
+void snapshot_collect(snapshot_objects_t *objects);
+
+/**
+ * The function writes copied web objects to a snapshot file and frees them.
+ * The file is written under a temporary name and renamed into place, so a
+ * crash never leaves a torn snapshot behind. The cache lock is not needed.
+ *
+ * @param path The snapshot file.
+ * @param objects The objects from snapshot_collect().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int snapshot_save(const char *path, snapshot_objects_t *objects);
+
+/**
+ * The function maps a snapshot file left by a previous run. No index is built
+ * up front; snapshot_find() probes the mapped slot table directly.
+ *
+ * @param path The snapshot file.
+ *
+ * @return the number of objects in the snapshot, or -1 if there is no usable
+ * snapshot.
+ */
+int snapshot_load(const char *path);
+
+/**
+ * The function looks up a key in the mapped snapshot. Each object is handed
+ * out once, after which it is expected to live in the memory cache.
+ *
+ * @param key The uri used as the cache key.
+ * @param value Set to the web object inside the mapping.
+ * @param length Set to the length of the web object.
+ *
+ * @return true if the key was found.
+ */
+bool snapshot_find(const char *key, const char **value, size_t *length);
+
+/**
+ * The function hands every object not yet claimed by snapshot_find() to a
+ * restore callback, so the whole snapshot can be moved into the memory cache
+ * in the background after startup.
+ *
+ * @param restore The function receiving each key and web object.
+ *
+ * @return the number of objects restored.
+ */
+int snapshot_restore(void (*restore)(char key[], const char *value,
+                                     size_t length));
+
+/**
+ * @brief clean snapshot resource
+ * The function `snapshot_free` unmaps the snapshot file.
+ */
+void snapshot_free(void);
+
+#endif /* SNAPSHOT_H */
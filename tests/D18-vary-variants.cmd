@@ -0,0 +1,37 @@
+# Make sure a response with Vary is cached once per request header value
+serve s1
+vary s1 Accept-Language
+generate random-text1.txt 20K
+header Accept-Language en
+request r1a random-text1.txt s1
+wait r1a
+respond r1a
+wait r1a
+check r1a
+# A different value is a different variant, fetched from the server
+header Accept-Language fr
+request r1b random-text1.txt s1
+wait r1b
+respond r1b
+wait r1b
+check r1b
+# Both variants should be served from the cache, without a response
+header Accept-Language en
+request r1c random-text1.txt s1
+wait r1c
+check r1c
+# Header names are case-insensitive
+header Accept-Language
+header ACCEPT-LANGUAGE fr
+request r1d random-text1.txt s1
+wait r1d
+check r1d
+# A value not cached yet must go to the server
+header ACCEPT-LANGUAGE de
+request r1e random-text1.txt s1
+wait r1e
+respond r1e
+wait r1e
+check r1e
+delete random-text1.txt
+quit
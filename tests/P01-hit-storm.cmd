@@ -0,0 +1,18 @@
+option timeout 20000
+option error 1
+# Performance: a storm of requests for objects already in the cache
+serve s1
+generate hit01.txt 10K
+generate hit02.bin 20K
+generate hit03.txt 5K
+# Warm the cache
+fetch f01 hit01.txt s1
+fetch f02 hit02.bin s1
+fetch f03 hit03.txt s1
+wait *
+# Every request should now be a hit
+load L1 300 4000 poisson hit01.txt hit02.bin hit03.txt s1
+wait L1
+check L1
+latency L1
+quit
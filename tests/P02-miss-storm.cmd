@@ -0,0 +1,29 @@
+option timeout 20000
+option error 1
+# Performance: requests cycling through more data than the cache holds
+# The 30 objects add up to 1.5MB, so LRU evicts each one before it is
+# requested again and every request goes to the server
+serve s1 s2
+generate miss01.bin 50K
+generate miss02.bin 50K
+generate miss03.bin 50K
+generate miss04.bin 50K
+generate miss05.bin 50K
+generate miss06.bin 50K
+generate miss07.bin 50K
+generate miss08.bin 50K
+generate miss09.bin 50K
+generate miss10.bin 50K
+generate miss11.bin 50K
+generate miss12.bin 50K
+generate miss13.bin 50K
+generate miss14.bin 50K
+generate miss15.bin 50K
+load L1 60 4000 poisson miss01.bin miss02.bin miss03.bin miss04.bin miss05.bin miss06.bin miss07.bin miss08.bin miss09.bin miss10.bin miss11.bin miss12.bin miss13.bin miss14.bin miss15.bin s1
+load L2 60 4000 poisson miss01.bin miss02.bin miss03.bin miss04.bin miss05.bin miss06.bin miss07.bin miss08.bin miss09.bin miss10.bin miss11.bin miss12.bin miss13.bin miss14.bin miss15.bin s2
+wait L1 L2
+check L1
+check L2
+latency L1
+latency L2
+quit
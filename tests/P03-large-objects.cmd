@@ -0,0 +1,11 @@
+option timeout 20000
+option error 1
+# Performance: streaming objects too large to cache
+serve s1
+generate large01.bin 1M
+generate large02.bin 2M
+load L1 10 4000 poisson large01.bin large02.bin s1
+wait L1
+check L1
+latency L1
+quit
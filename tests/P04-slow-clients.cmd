@@ -0,0 +1,69 @@
+option timeout 20000
+option error 1
+option linefeed 0
+# Performance: hits served while many connections wait on a slow server
+# Like D17-stress, but with a steady load measured on top
+serve s0 s1
+generate slow00.bin 50K
+generate slow01.bin 20K
+generate fast01.txt 10K
+fetch f01 fast01.txt s1
+wait f01
+# Forty requests the server holds until the load is over
+request r00 slow00.bin s0
+request r01 slow01.bin s0
+request r02 slow00.bin s0
+request r03 slow01.bin s0
+request r04 slow00.bin s0
+request r05 slow01.bin s0
+request r06 slow00.bin s0
+request r07 slow01.bin s0
+request r08 slow00.bin s0
+request r09 slow01.bin s0
+request r10 slow00.bin s0
+request r11 slow01.bin s0
+request r12 slow00.bin s0
+request r13 slow01.bin s0
+request r14 slow00.bin s0
+request r15 slow01.bin s0
+request r16 slow00.bin s0
+request r17 slow01.bin s0
+request r18 slow00.bin s0
+request r19 slow01.bin s0
+request r20 slow00.bin s0
+request r21 slow01.bin s0
+request r22 slow00.bin s0
+request r23 slow01.bin s0
+request r24 slow00.bin s0
+request r25 slow01.bin s0
+request r26 slow00.bin s0
+request r27 slow01.bin s0
+request r28 slow00.bin s0
+request r29 slow01.bin s0
+request r30 slow00.bin s0
+request r31 slow01.bin s0
+request r32 slow00.bin s0
+request r33 slow01.bin s0
+request r34 slow00.bin s0
+request r35 slow01.bin s0
+request r36 slow00.bin s0
+request r37 slow01.bin s0
+request r38 slow00.bin s0
+request r39 slow01.bin s0
+wait *
+load L1 200 4000 poisson fast01.txt s1
+wait L1
+check L1
+latency L1
+respond r00 r01 r02 r03 r04 r05 r06 r07 r08 r09
+respond r10 r11 r12 r13 r14 r15 r16 r17 r18 r19
+respond r20 r21 r22 r23 r24 r25 r26 r27 r28 r29
+respond r30 r31 r32 r33 r34 r35 r36 r37 r38 r39
+wait *
+# Give the clients time to read the responses
+delay 1000
+check r00
+check r13
+check r26
+check r39
+quit
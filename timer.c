@@ -0,0 +1,275 @@
+/**
+ * @file timer.c
+ * @brief Hierarchical timer wheel
+ *
+ * The wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots. Level 0 slots are
+ * one tick wide, and each higher level covers WHEEL_SLOTS times the range of
+ * the one below it. A timer is placed in the lowest level whose range covers
+ * its distance from now. Whenever a lower level wraps around, the current
+ * slot of the next level is cascaded: its timers are reinserted, landing one
+ * or more levels further down. Level 0 slots are expired as the clock
+ * reaches them.
+ *
+ * Each slot is a circular doubly linked list with a sentinel head, so
+ * arming and cancelling only splice a timer in or out. A timer's slot is
+ * never due later than its deadline, so a later deadline is only stored and
+ * the ticking thread moves the timer on when the slot comes due.
+ */
+
+#include "timer.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+/* Furthest a timer can be placed, about 46 hours at 10ms a tick */
+#define WHEEL_RANGE ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static wheel_timer_t wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t now_tick = 0;
+
+/*
+ * unlink_timer - splice a timer out of its slot
+ */
+static void unlink_timer(wheel_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = timer;
+}
+
+/*
+ * place_timer - insert a timer in the slot covering its expiry tick
+ */
+static void place_timer(wheel_timer_t *timer) {
+    wheel_timer_t *head;
+    uint64_t delta;
+    int level;
+
+    /*the current slot is being expired, the earliest is the next one*/
+    if (timer->expires <= now_tick) {
+        timer->expires = now_tick + 1;
+    }
+    delta = timer->expires - now_tick;
+    if (delta >= WHEEL_RANGE) {
+        timer->expires = now_tick + WHEEL_RANGE - 1;
+        delta = WHEEL_RANGE - 1;
+    }
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta < ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    head = &wheel[level][(timer->expires >> (WHEEL_BITS * level)) &
+                         WHEEL_MASK];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/*
+ * take_slot - detach all timers of a slot into a private list
+ */
+static void take_slot(wheel_timer_t *head, wheel_timer_t *list) {
+    if (head->next == head) {
+        list->next = list->prev = list;
+        return;
+    }
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->next = head->prev = head;
+}
+
+/*
+ * advance - move the clock one tick, cascading and expiring timers
+ */
+static void advance(void) {
+    wheel_timer_t list, *timer;
+    int level;
+
+    __atomic_store_n(&now_tick, now_tick + 1, __ATOMIC_RELAXED);
+    /*each level whose lower neighbor wrapped gets its slot cascaded*/
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        if (((now_tick >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) != 0) {
+            break;
+        }
+        take_slot(
+            &wheel[level][(now_tick >> (WHEEL_BITS * level)) & WHEEL_MASK],
+            &list);
+        while ((timer = list.next) != &list) {
+            unlink_timer(timer);
+            place_timer(timer);
+        }
+    }
+
+    take_slot(&wheel[0][now_tick & WHEEL_MASK], &list);
+    while ((timer = list.next) != &list) {
+        unlink_timer(timer);
+        /*a deadline stored before this is seen, or it sees the timer out*/
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        /*touched since it was placed, move it instead of firing*/
+        uint64_t deadline =
+            __atomic_load_n(&timer->deadline, __ATOMIC_ACQUIRE);
+        if (deadline > now_tick) {
+            timer->expires = deadline;
+            place_timer(timer);
+            continue;
+        }
+        timer->expire(timer);
+    }
+}
+
+/*
+ * tick_thread - advance the wheel to match the monotonic clock
+ */
+static void *tick_thread(void *vargp) {
+    struct timespec start, now, next;
+    uint64_t target;
+
+    (void)vargp;
+    pthread_detach(pthread_self());
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = start;
+    while (1) {
+        next.tv_nsec += TIMER_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        /*catch up on ticks missed while descheduled*/
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        target = ((now.tv_sec - start.tv_sec) * 1000 +
+                  (now.tv_nsec - start.tv_nsec) / 1000000) /
+                 TIMER_TICK_MS;
+        pthread_mutex_lock(&wheel_lock);
+        while (now_tick < target) {
+            advance();
+        }
+        pthread_mutex_unlock(&wheel_lock);
+    }
+    return NULL;
+}
+
+/*
+ * ticks_from_now - expiry tick for a delay in milliseconds
+ *
+ * Rounds up, plus one tick because the clock may already be part way
+ * through the current one; timers never fire early.
+ */
+static uint64_t ticks_from_now(unsigned ms) {
+    return __atomic_load_n(&now_tick, __ATOMIC_RELAXED) +
+           (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS + 1;
+}
+
+/*
+ * push_deadline - store a deadline without the lock if it is no earlier
+ * than any given since the timer was armed, so its slot is not due later
+ *
+ * Returns false if the timer is not armed or the deadline is earlier.
+ */
+static bool push_deadline(wheel_timer_t *timer, uint64_t deadline) {
+    if (timer->latest == 0 || deadline < timer->latest) {
+        return false;
+    }
+    timer->latest = deadline;
+    __atomic_store_n(&timer->deadline, deadline, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * The function initializes the wheel and starts the ticking thread.
+ *
+ * @return 0 on success, -1 if the thread could not be created.
+ */
+int timer_wheel_start(void) {
+    int level, slot;
+    pthread_t tid;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < WHEEL_SLOTS; slot++) {
+            timer_init(&wheel[level][slot]);
+        }
+    }
+    return pthread_create(&tid, NULL, tick_thread, NULL) == 0 ? 0 : -1;
+}
+
+/**
+ * The function initializes a timer so it can be cancelled before being
+ * armed.
+ *
+ * @param timer The timer.
+ */
+void timer_init(wheel_timer_t *timer) {
+    timer->prev = timer->next = timer;
+    timer->expires = 0;
+    timer->deadline = 0;
+    timer->latest = 0;
+    timer->expire = NULL;
+}
+
+/**
+ * The function arms, or re-arms, a timer. The callback runs on the ticking
+ * thread with the wheel lock held, so it must be short and must not call any
+ * timer function. Re-arming an armed timer with the same callback and a
+ * deadline no earlier than any given since it was armed takes no lock, as in
+ * timer_touch().
+ *
+ * @param timer The timer.
+ * @param ms Milliseconds from now.
+ * @param expire The callback.
+ */
+void timer_arm(wheel_timer_t *timer, unsigned ms,
+               void (*expire)(wheel_timer_t *timer)) {
+    uint64_t deadline = ticks_from_now(ms);
+
+    if (timer->expire == expire && push_deadline(timer, deadline)) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        /*unless it was taken out to fire, the ticking thread sees the store*/
+        if (__atomic_load_n(&timer->next, __ATOMIC_RELAXED) != timer) {
+            return;
+        }
+    }
+    pthread_mutex_lock(&wheel_lock);
+    unlink_timer(timer);
+    timer->expire = expire;
+    timer->expires = deadline;
+    timer->deadline = deadline;
+    place_timer(timer);
+    pthread_mutex_unlock(&wheel_lock);
+    timer->latest = deadline;
+}
+
+/**
+ * The function pushes the deadline of an armed timer further out without
+ * taking the wheel lock. The timer stays in its slot and is moved when that
+ * slot comes due, which makes this cheap enough to call on every read. A
+ * deadline earlier than one already given is ignored.
+ *
+ * @param timer The armed timer.
+ * @param ms Milliseconds from now.
+ */
+void timer_touch(wheel_timer_t *timer, unsigned ms) {
+    push_deadline(timer, ticks_from_now(ms));
+}
+
+/**
+ * The function disarms a timer. Once it returns the callback is neither
+ * running nor going to run.
+ *
+ * @param timer The timer.
+ */
+void timer_cancel(wheel_timer_t *timer) {
+    pthread_mutex_lock(&wheel_lock);
+    unlink_timer(timer);
+    pthread_mutex_unlock(&wheel_lock);
+    timer->latest = 0;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file timer.h
+ * @brief Definitions and interfaces for timer.c
+ *
+ * A hierarchical timer wheel driven by one ticking thread. Arming and
+ * cancelling a timer are O(1) list operations, so the wheel can hold a timer
+ * for every open connection.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Milliseconds per wheel tick */
+#define TIMER_TICK_MS 10
+
+/*timer embedded in the object it times out*/
+typedef struct WheelTimer {
+    struct WheelTimer *prev;                  /*slot list links*/
+    struct WheelTimer *next;                  /*slot list links*/
+    uint64_t expires;                         /*tick of the slot it sits in*/
+    uint64_t deadline;                        /*tick it really expires at*/
+    uint64_t latest;                          /*furthest deadline, 0 if disarmed*/
+    void (*expire)(struct WheelTimer *timer); /*callback*/
+} wheel_timer_t;
+
+/**
+ * The function initializes the wheel and starts the ticking thread.
+ *
+ * @return 0 on success, -1 if the thread could not be created.
+ */
+int timer_wheel_start(void);
+
+/**
+ * The function initializes a timer so it can be cancelled before being
+ * armed.
+ *
+ * @param timer The timer.
+ */
+void timer_init(wheel_timer_t *timer);
+
+/**
+ * The function arms, or re-arms, a timer. The callback runs on the ticking
+ * thread with the wheel lock held, so it must be short and must not call any
+ * timer function. Re-arming an armed timer with the same callback and a
+ * deadline no earlier than any given since it was armed takes no lock, as in
+ * timer_touch().
+ *
+ * @param timer The timer.
+ * @param ms Milliseconds from now.
+ * @param expire The callback.
+ */
+void timer_arm(wheel_timer_t *timer, unsigned ms,
+               void (*expire)(wheel_timer_t *timer));
+
+/**
+ * The function pushes the deadline of an armed timer further out without
+ * taking the wheel lock. The timer stays in its slot and is moved when that
+ * slot comes due, which makes this cheap enough to call on every read. A
+ * deadline earlier than one already given is ignored.
+ *
+ * @param timer The armed timer.
+ * @param ms Milliseconds from now.
+ */
+void timer_touch(wheel_timer_t *timer, unsigned ms);
+
+/**
+ * The function disarms a timer. Once it returns the callback is neither
+ * running nor going to run.
+ *
+ * @param timer The timer.
+ */
+void timer_cancel(wheel_timer_t *timer);
+
+#endif /* TIMER_H */
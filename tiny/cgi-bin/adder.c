@@ -1,20 +1,28 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ * Started by tiny -w, it stays up as a persistent worker (see ../cgi.h).
  */
 /* $begin adder */
 #include "csapp.h"
+#include "../cgi.h"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-int main(void) {
-    char *buf, *p;
+/*
+ * adder - write the response to one query string to stdout
+ */
+void adder(char *buf) {
+    char *p;
     char content[MAXLINE];
     int n1=0, n2=0;
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
+    if (buf != NULL) {
         p = strchr(buf, '&');
         if (p != NULL) {
             *p = '\0';
@@ -38,7 +46,31 @@ int main(void) {
     printf("\r\n");
     printf("%s", content);
     fflush(stdout);
+}
+
+int main(void) {
+    char *worker = getenv(CGI_WORKER_ENV);
+    char query[MAXLINE];
+    int sock, fd, null;
+
+    if (worker == NULL) {
+        adder(getenv("QUERY_STRING"));
+        exit(0);
+    }
 
+    /* Persistent worker: answer requests until tiny goes away */
+    sock = atoi(worker);
+    if (cgi_ready(sock) < 0) {
+        exit(1);
+    }
+    null = open("/dev/null", O_WRONLY);
+    while ((fd = cgi_receive(sock, query, sizeof(query))) >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+        adder(query);
+        /* Drop the last reference to the client so it sees the end */
+        dup2(null, STDOUT_FILENO);
+    }
     exit(0);
 }
 /* $end adder */
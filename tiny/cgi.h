@@ -0,0 +1,95 @@
+/*
+ * cgi.h - protocol between tiny and its persistent CGI workers
+ *
+ * With -w, tiny starts each program in ./cgi-bin once per worker, with
+ * TINY_WORKER_FD naming one end of a SOCK_SEQPACKET socket pair. The worker
+ * first sends CGI_READY on it. Every message tiny sends after that is one
+ * request: the query string as data, with the client socket attached as
+ * SCM_RIGHTS. The worker writes the rest of the response after tiny's
+ * status line to that socket, closes it, and waits for the next message. A
+ * program that does not look at TINY_WORKER_FD never sends CGI_READY, so
+ * tiny does not pool it and forks it for every request instead.
+ */
+#ifndef __CGI_H__
+#define __CGI_H__
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define CGI_WORKER_ENV "TINY_WORKER_FD"
+/* First message of a worker, before any request */
+#define CGI_READY "ready"
+
+/*
+ * cgi_ready - tell tiny the program is a worker
+ *
+ * Returns 0 on success, or -1 if tiny has gone away.
+ */
+static inline int cgi_ready(int sock) {
+    return send(sock, CGI_READY, sizeof(CGI_READY), MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/*
+ * cgi_send - hand a request to a worker
+ *
+ * Returns 0 on success, or -1 if the worker is gone.
+ */
+static inline int cgi_send(int sock, int fd, const char *query) {
+    struct iovec iov = { (void *) query, strlen(query) + 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/*
+ * cgi_receive - wait for the next request in a worker
+ *
+ * query - The buffer receiving the NUL-terminated query string.
+ * Returns the client socket, or -1 once tiny has gone away.
+ */
+static inline int cgi_receive(int sock, char *query, size_t size) {
+    struct iovec iov = { query, size - 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+    int fd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if ((n = recvmsg(sock, &msg, 0)) <= 0) {
+        return -1;
+    }
+    query[n] = '\0';
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+#endif /* __CGI_H__ */
@@ -9,28 +9,68 @@
  * Updated 11/2022 - Gilbert Fan <gsfan@andrew.cmu.edu>, Adittyo Paul <adittyop@andrew.cmu.edu>
  * Updated tiny to use http_parser instead of sscanf. Also changed
  * parse_uri into parse_path instead as the parsed string is a PATH.
+ *
+ * By default tiny serves one connection at a time and closes it after one
+ * response. For use as a benchmark origin, -t serves every connection on its
+ * own thread and -k keeps connections open across static requests (HTTP/1.1,
+ * or HTTP/1.0 with "Connection: keep-alive").
+ *
+ * Static files are sent with sendfile() from a small cache of open files,
+ * whose response headers, with Last-Modified and ETag validators, are built
+ * once. Conditional requests matching the validators get a 304.
+ *
+ * With -w, every program in ./cgi-bin is started as a pool of persistent
+ * workers at startup, and dynamic requests are passed to them over Unix
+ * sockets instead of forking the program each time.
+ *
+ * /gen?size=N&delay_ms=D&rate=R&cacheable=1 is a synthetic object: N bytes
+ * generated in memory, the same bytes for the same N, sent after a first
+ * byte delay of D milliseconds at no more than R bytes per second. With
+ * cacheable=1 it can be cached for an hour and revalidated by its ETag,
+ * otherwise it is marked no-store.
  */
 
 #include "csapp.h"
 #include "http_parser.h"
+#include "cgi.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <strings.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
 #define HOSTLEN 256
 #define SERVLEN 8
+/* Seconds an idle persistent connection is kept open */
+#define KEEPALIVE_TIMEOUT 5
+/* Number of open files kept, and seconds before one is stat()ed again */
+#define FILE_CACHE_SIZE 64
+#define FILE_CACHE_VALID 1
+/* Most CGI programs, and workers per program, with -w */
+#define MAX_PROGRAMS 16
+#define MAX_WORKERS 64
+/* Milliseconds a new worker has to send CGI_READY */
+#define CGI_READY_TIMEOUT 1000
+/* Largest synthetic object */
+#define GEN_MAX_SIZE (1L << 30)
 
 /* Typedef for convenience */
 typedef struct sockaddr SA;
@@ -51,6 +91,38 @@ typedef enum {
     PARSE_DYNAMIC
 } parse_result;
 
+/* A static file kept open with its response headers. */
+typedef struct {
+    char filename[MAXLINE];     // Name it was opened by
+    int fd;                     // Open file, read with sendfile()
+    int refs;                   // Requests sending it, plus one if cached
+    struct stat sbuf;           // Identity when it was opened
+    time_t checked;             // Last time the name was stat()ed
+    char etag[64];              // Entity tag, quoted
+    char modified[32];          // Modification time, HTTP date format
+    char validators[160];       // ETag and Last-Modified headers
+    char headers[512];          // All headers but status and Connection
+} open_file;
+
+/* Persistent workers running one CGI program. */
+typedef struct {
+    char filename[MAXLINE];     // Program, as parse_path names it
+    int socks[MAX_WORKERS];     // Our end of each worker's socket, or -1
+    pid_t pids[MAX_WORKERS];    // Worker processes, 0 once reaped
+    int nworkers;               // Workers started
+    unsigned next;              // Worker for the next request
+    pthread_mutex_t lock;       // Held while a worker is restarted
+} cgi_pool;
+
+static open_file *file_cache[FILE_CACHE_SIZE];
+static cgi_pool cgi_pools[MAX_PROGRAMS];
+static int ncgi_pools = 0;
+static pthread_mutex_t file_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Command line options */
+static bool concurrent = false; // -t: one thread per connection
+static bool keepalive = false;  // -k: persistent connections
+static int nworkers = 0;        // -w: CGI workers per program
 
 /*
  * parse_path - parse PATH into filename and CGI args
@@ -136,26 +208,163 @@ void get_filetype(char *filename, char *filetype) {
 
 
 /*
- * serve_static - copy a file back to the client
+ * file_release - drop a reference to an open file, closing it with the last
  */
-void serve_static(int fd, char *filename, int filesize) {
-    printf("SERVE STATIC\n");
-    int srcfd;
-    char *srcp;
+void file_release(open_file *file) {
+    pthread_mutex_lock(&file_cache_lock);
+    int refs = --file->refs;
+    pthread_mutex_unlock(&file_cache_lock);
+    if (refs == 0) {
+        close(file->fd);
+        free(file);
+    }
+}
+
+/*
+ * file_open - open a file and build its response headers
+ */
+open_file *file_open(char *filename, struct stat *sbuf) {
+    open_file *file = malloc(sizeof(open_file));
+    if (file == NULL) {
+        return NULL;
+    }
+    file->fd = open(filename, O_RDONLY, 0);
+    if (file->fd < 0) {
+        perror(filename);
+        free(file);
+        return NULL;
+    }
+    snprintf(file->filename, MAXLINE, "%s", filename);
+    file->refs = 1;
+    file->sbuf = *sbuf;
+    file->checked = time(NULL);
+
     char filetype[MAXLINE];
+    struct tm tm;
+    get_filetype(filename, filetype);
+    strftime(file->modified, sizeof(file->modified),
+             "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&sbuf->st_mtime, &tm));
+    snprintf(file->etag, sizeof(file->etag), "\"%lx-%llx-%lx\"",
+             (unsigned long) sbuf->st_ino, (unsigned long long) sbuf->st_size,
+             (unsigned long) sbuf->st_mtime);
+    size_t validlen = snprintf(file->validators, sizeof(file->validators),
+            "Last-Modified: %s\r\n" \
+            "ETag: %s\r\n", \
+            file->modified, file->etag);
+    size_t headerslen = snprintf(file->headers, sizeof(file->headers),
+            "Server: Tiny Web Server\r\n" \
+            "Content-Length: %lld\r\n" \
+            "Content-Type: %s\r\n" \
+            "%s", \
+            (long long) sbuf->st_size, filetype, file->validators);
+    if (validlen >= sizeof(file->validators) ||
+        headerslen >= sizeof(file->headers)) {
+        close(file->fd);
+        free(file);
+        return NULL; // Overflow!
+    }
+    return file;
+}
+
+/*
+ * file_get - find a static file in the open file cache, opening it on a miss
+ *
+ * A cached file is used as is for FILE_CACHE_VALID seconds, then its name is
+ * stat()ed again and the file reopened if it changed. The caller owns a
+ * reference it must drop with file_release(). Returns NULL with errno set to
+ * ENOENT if the file does not exist, or EACCES if it cannot be served.
+ */
+open_file *file_get(char *filename) {
+    unsigned long hash = 5381;
+    for (char *c = filename; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char) *c;
+    }
+    int slot = hash % FILE_CACHE_SIZE;
+    open_file *file;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&file_cache_lock);
+    file = file_cache[slot];
+    if (file != NULL && strcmp(file->filename, filename) == 0 &&
+        now - file->checked < FILE_CACHE_VALID) {
+        file->refs++;
+        pthread_mutex_unlock(&file_cache_lock);
+        return file;
+    }
+    pthread_mutex_unlock(&file_cache_lock);
+
+    struct stat sbuf;
+    if (stat(filename, &sbuf) < 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
+        errno = EACCES;
+        return NULL;
+    }
+
+    /* Still the same file, trust it for another while */
+    pthread_mutex_lock(&file_cache_lock);
+    file = file_cache[slot];
+    if (file != NULL && strcmp(file->filename, filename) == 0 &&
+        file->sbuf.st_ino == sbuf.st_ino &&
+        file->sbuf.st_size == sbuf.st_size &&
+        file->sbuf.st_mtime == sbuf.st_mtime) {
+        file->checked = now;
+        file->refs++;
+        pthread_mutex_unlock(&file_cache_lock);
+        return file;
+    }
+    pthread_mutex_unlock(&file_cache_lock);
+
+    file = file_open(filename, &sbuf);
+    if (file == NULL) {
+        errno = EACCES;
+        return NULL;
+    }
+    /* One reference for the cache, one for the caller */
+    pthread_mutex_lock(&file_cache_lock);
+    open_file *old = file_cache[slot];
+    file_cache[slot] = file;
+    file->refs++;
+    pthread_mutex_unlock(&file_cache_lock);
+    if (old != NULL) {
+        file_release(old);
+    }
+    return file;
+}
+
+/*
+ * not_modified - check the validators of a conditional request
+ */
+bool not_modified(parser_t *parser, open_file *file) {
+    header_t *header = parser_lookup_header(parser, "If-None-Match");
+    if (header != NULL) {
+        return strcmp(header->value, file->etag) == 0 ||
+               strcmp(header->value, "*") == 0;
+    }
+    /* Dates are only ever the ones tiny sent, compare them as text */
+    header = parser_lookup_header(parser, "If-Modified-Since");
+    return header != NULL && strcmp(header->value, file->modified) == 0;
+}
+
+/*
+ * serve_static - send a file back to the client
+ */
+void serve_static(int fd, open_file *file, parser_t *parser, bool keep) {
+    printf("SERVE STATIC\n");
     char buf[MAXBUF];
     size_t buflen;
-
-    get_filetype(filename, filetype);
+    bool fresh = not_modified(parser, file);
 
     /* Send response headers to client */
     buflen = snprintf(buf, MAXBUF,
-            "HTTP/1.0 200 OK\r\n" \
-            "Server: Tiny Web Server\r\n" \
-            "Connection: close\r\n" \
-            "Content-Length: %d\r\n" \
-            "Content-Type: %s\r\n\r\n", \
-            filesize, filetype);
+            "HTTP/1.0 %s\r\n" \
+            "Connection: %s\r\n" \
+            "%s\r\n", \
+            fresh ? "304 Not Modified" : "200 OK",
+            keep ? "keep-alive" : "close",
+            fresh ? file->validators : file->headers);
     if (buflen >= MAXBUF) {
         return; // Overflow!
     }
@@ -166,33 +375,237 @@ void serve_static(int fd, char *filename, int filesize) {
         fprintf(stderr, "Error writing static response headers to client\n");
         return;
     }
+    if (fresh) {
+        return;
+    }
 
+    /* Send response body to client, straight from the page cache */
+    off_t offset = 0;
+    while (offset < file->sbuf.st_size) {
+        ssize_t n = sendfile(fd, file->fd, &offset,
+                             file->sbuf.st_size - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Error writing static file \"%s\" to client\n",
+                    file->filename);
+            return;
+        }
+    }
+}
 
-    /* Send response body to client */
-    srcfd = open(filename, O_RDONLY, 0);
-    if (srcfd < 0) {
-        perror(filename);
-        return;
+/*
+ * cgi_handshake - wait for a new worker to send CGI_READY
+ * Returns 0 if it did, or -1 if it exited, timed out or sent anything else.
+ */
+int cgi_handshake(int sock) {
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    char buf[sizeof(CGI_READY)];
+
+    if (poll(&pfd, 1, CGI_READY_TIMEOUT) != 1) {
+        return -1;
     }
+    if (recv(sock, buf, sizeof(buf), 0) != sizeof(CGI_READY) ||
+        memcmp(buf, CGI_READY, sizeof(CGI_READY)) != 0) {
+        return -1;
+    }
+    return 0;
+}
 
-    srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    if (srcp == MAP_FAILED) {
-        perror("mmap");
-        close(srcfd);
-        return;
+/*
+ * cgi_spawn - start one persistent worker running a CGI program
+ * pid - Receives the worker's process id.
+ * Returns our end of its socket, or -1 on error or if the program turns out
+ * not to be a worker.
+ */
+int cgi_spawn(char *filename, pid_t *pid) {
+    char *emptylist[] = { NULL };
+    char sockname[16];
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    *pid = fork();
+    if (*pid == 0) { /* Child */
+        close(sv[0]);
+        /* A worker restarted later must not hold clients' sockets open */
+        long maxfd = sysconf(_SC_OPEN_MAX);
+        for (long i = STDERR_FILENO + 1; i < maxfd; i++) {
+            if (i != sv[1]) {
+                close(i);
+            }
+        }
+        snprintf(sockname, sizeof(sockname), "%d", sv[1]);
+        setenv(CGI_WORKER_ENV, sockname, 1);
+
+        /* Output goes to the client sockets it is handed */
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+
+        if (execve(filename, emptylist, environ) < 0) {
+            perror(filename);
+            exit(1);  /* Exit child process */
+        }
     }
-    close(srcfd);
+    close(sv[1]);
+    if (*pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        return -1;
+    }
+    /* A program that is no worker must never be handed a request */
+    if (cgi_handshake(sv[0]) < 0) {
+        kill(*pid, SIGKILL);
+        waitpid(*pid, NULL, 0);
+        close(sv[0]);
+        return -1;
+    }
+    /* Workers started later must not hold on to this one's socket */
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    return sv[0];
+}
 
-    if (rio_writen(fd, srcp, filesize) < 0) {
-        fprintf(stderr, "Error writing static file \"%s\" to client\n",
-                filename);
-        // Fall through to cleanup
+/*
+ * cgi_reap - SIGCHLD handler, reaps the workers that have exited
+ *
+ * Only workers are waited for: serve_dynamic reaps the children it forks.
+ * cgi_dispatch starts a new worker the next time a request fails to reach
+ * the exited one.
+ */
+void cgi_reap(int sig) {
+    int olderrno = errno;
+
+    (void) sig;
+    for (int i = 0; i < ncgi_pools; i++) {
+        cgi_pool *pool = &cgi_pools[i];
+        for (int j = 0; j < pool->nworkers; j++) {
+            pid_t pid = __atomic_load_n(&pool->pids[j], __ATOMIC_RELAXED);
+            /* Unless cgi_restart has already put a new worker there */
+            if (pid > 0 && waitpid(pid, NULL, WNOHANG) > 0) {
+                __atomic_compare_exchange_n(&pool->pids[j], &pid, 0, false,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED);
+            }
+        }
     }
+    errno = olderrno;
+}
+
+/*
+ * cgi_start_pools - start nworkers workers for every program in ./cgi-bin
+ */
+void cgi_start_pools(void) {
+    DIR *dir = opendir("cgi-bin");
+    struct dirent *entry;
+    struct stat sbuf;
 
-    if (munmap(srcp, filesize) < 0) {
-        perror("munmap");
+    if (dir == NULL) {
+        perror("cgi-bin");
         return;
     }
+    while ((entry = readdir(dir)) != NULL && ncgi_pools < MAX_PROGRAMS) {
+        cgi_pool *pool = &cgi_pools[ncgi_pools];
+        if (snprintf(pool->filename, MAXLINE, "./cgi-bin/%s",
+                     entry->d_name) >= MAXLINE ||
+            stat(pool->filename, &sbuf) < 0 ||
+            !(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+            continue;
+        }
+        pool->nworkers = 0;
+        pool->next = 0;
+        pthread_mutex_init(&pool->lock, NULL);
+        for (int i = 0; i < nworkers; i++) {
+            pid_t pid;
+            int sock = cgi_spawn(pool->filename, &pid);
+            if (sock < 0) {
+                break;
+            }
+            pool->pids[pool->nworkers] = pid;
+            pool->socks[pool->nworkers++] = sock;
+        }
+        printf("Started %d workers for %s\n", pool->nworkers,
+               pool->filename);
+        ncgi_pools++;
+    }
+    closedir(dir);
+}
+
+/*
+ * cgi_restart - replace a worker that a request could not be sent to
+ * pid - The worker's process id when the request was sent.
+ *
+ * The new worker takes over the old one's descriptor number with dup2, so
+ * requests being sent concurrently reach it too. A program that no longer
+ * starts as a worker gives up the slot, and its requests are forked.
+ */
+void cgi_restart(cgi_pool *pool, int slot, pid_t pid) {
+    pthread_mutex_lock(&pool->lock);
+    pid_t old = __atomic_load_n(&pool->pids[slot], __ATOMIC_RELAXED);
+    int sock = __atomic_load_n(&pool->socks[slot], __ATOMIC_RELAXED);
+
+    /* Another thread may have restarted it already */
+    if (sock < 0 || (old != pid && old != 0)) {
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    if (old > 0) {
+        kill(old, SIGKILL);
+        waitpid(old, NULL, 0);
+    }
+    pid_t new_pid;
+    int new_sock = cgi_spawn(pool->filename, &new_pid);
+    if (new_sock < 0) {
+        fprintf(stderr, "Worker %d for %s could not be restarted, "
+                "forking per request instead\n", slot, pool->filename);
+        __atomic_store_n(&pool->pids[slot], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&pool->socks[slot], -1, __ATOMIC_RELAXED);
+    } else {
+        dup2(new_sock, sock);
+        fcntl(sock, F_SETFD, FD_CLOEXEC);
+        close(new_sock);
+        __atomic_store_n(&pool->pids[slot], new_pid, __ATOMIC_RELAXED);
+        printf("Restarted worker %d for %s\n", slot, pool->filename);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * cgi_dispatch - pass a dynamic request to a worker of its program
+ * Returns 0 once a worker has the client, or -1 if none could take it.
+ */
+int cgi_dispatch(int fd, char *filename, char *cgiargs) {
+    for (int i = 0; i < ncgi_pools; i++) {
+        cgi_pool *pool = &cgi_pools[i];
+        if (strcmp(pool->filename, filename) != 0) {
+            continue;
+        }
+        /* Requests queue on each worker's socket, spread them round robin */
+        for (int tries = 0; tries < MAX_WORKERS; tries++) {
+            int n = __atomic_load_n(&pool->nworkers, __ATOMIC_RELAXED);
+            if (n == 0) {
+                return -1;
+            }
+            unsigned next = __atomic_fetch_add(&pool->next, 1,
+                                               __ATOMIC_RELAXED);
+            int slot = next % n;
+            pid_t pid = __atomic_load_n(&pool->pids[slot], __ATOMIC_RELAXED);
+            int sock = __atomic_load_n(&pool->socks[slot], __ATOMIC_RELAXED);
+            if (sock < 0) {
+                continue;
+            }
+            if (cgi_send(sock, fd, cgiargs) == 0) {
+                return 0;
+            }
+            /* That worker exited, start another in its place */
+            cgi_restart(pool, slot, pid);
+        }
+        return -1;
+    }
+    return -1;
 }
 
 /*
@@ -218,6 +631,11 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
         return;
     }
 
+    /* A persistent worker finishes the response if there is one */
+    if (nworkers > 0 && cgi_dispatch(fd, filename, cgiargs) == 0) {
+        return;
+    }
+
     pid_t pid = fork();
     if (pid == 0) { /* Child */
         /* Real server would set all CGI vars here */
@@ -238,8 +656,8 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
         return;
     }
 
-    /* Parent waits for and reaps child */
-    if (wait(NULL) < 0) {
+    /* Parent waits for and reaps its own child, other threads have theirs */
+    if (waitpid(pid, NULL, 0) < 0) {
         perror("wait");
         return;
     }
@@ -293,6 +711,123 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
     }
 }
 
+/*
+ * gen_param - value of a name=value parameter in a query string
+ * Returns the value, or def if the parameter is absent or malformed.
+ */
+long gen_param(const char *query, const char *name, long def) {
+    size_t len = strlen(name);
+    const char *p = query;
+
+    while (p != NULL && *p != '\0') {
+        if (strncmp(p, name, len) == 0 && p[len] == '=') {
+            char *end;
+            long value = strtol(p + len + 1, &end, 10);
+            if (end == p + len + 1 || (*end != '&' && *end != '\0') ||
+                value < 0) {
+                return def;
+            }
+            return value;
+        }
+        p = strchr(p, '&');
+        if (p != NULL) {
+            p++;
+        }
+    }
+    return def;
+}
+
+/*
+ * sleep_until - sleep until some seconds past a time on the monotonic clock
+ */
+void sleep_until(const struct timespec *base, double seconds) {
+    struct timespec when = *base;
+
+    when.tv_sec += (time_t) seconds;
+    when.tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+    if (when.tv_nsec >= 1000000000) {
+        when.tv_sec++;
+        when.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) ==
+           EINTR) {
+        ;
+    }
+}
+
+/*
+ * serve_gen - send a synthetic object described by its query string
+ */
+void serve_gen(int fd, const char *query, parser_t *parser, bool keep) {
+    printf("SERVE SYNTHETIC\n");
+    long size = gen_param(query, "size", 0);
+    long delay = gen_param(query, "delay_ms", 0);
+    long rate = gen_param(query, "rate", 0);
+    bool cacheable = gen_param(query, "cacheable", 0) != 0;
+    char etag[32];
+    char buf[MAXBUF];
+    size_t buflen;
+    struct timespec start;
+
+    if (size > GEN_MAX_SIZE) {
+        clienterror(fd, "400", "Bad Request",
+                    "Tiny won't generate an object that large");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* The body only depends on the size, so the size makes a strong tag */
+    snprintf(etag, sizeof(etag), "\"gen-%ld\"", size);
+    header_t *header = parser_lookup_header(parser, "If-None-Match");
+    bool fresh = cacheable && header != NULL &&
+                 strcmp(header->value, etag) == 0;
+
+    /* Time to first byte */
+    sleep_until(&start, delay / 1000.0);
+
+    /* Send response headers to client */
+    buflen = snprintf(buf, MAXBUF,
+            "HTTP/1.0 %s\r\n" \
+            "Server: Tiny Web Server\r\n" \
+            "Connection: %s\r\n" \
+            "Content-Length: %ld\r\n" \
+            "Content-Type: application/octet-stream\r\n" \
+            "Cache-Control: %s\r\n" \
+            "ETag: %s\r\n\r\n", \
+            fresh ? "304 Not Modified" : "200 OK",
+            keep ? "keep-alive" : "close", fresh ? 0 : size,
+            cacheable ? "max-age=3600" : "no-store", etag);
+    if (buflen >= MAXBUF) {
+        return; // Overflow!
+    }
+    if (rio_writen(fd, buf, buflen) < 0) {
+        fprintf(stderr, "Error writing synthetic response headers\n");
+        return;
+    }
+    if (fresh) {
+        return;
+    }
+
+    /* Send response body to client, pacing it to the rate */
+    for (long sent = 0; sent < size; ) {
+        long n = size - sent < MAXBUF ? size - sent : MAXBUF;
+        if (rate > 0 && n > rate / 10 + 1) {
+            n = rate / 10 + 1;
+        }
+        for (long i = 0; i < n; i++) {
+            buf[i] = 'a' + (sent + i + size) % 26;
+        }
+        if (rio_writen(fd, buf, n) < 0) {
+            fprintf(stderr, "Error writing synthetic body to client\n");
+            return;
+        }
+        sent += n;
+        if (rate > 0) {
+            sleep_until(&start, delay / 1000.0 + (double) sent / rate);
+        }
+    }
+}
+
 /*
  * read_requesthdrs - read HTTP request headers
  * Returns true if an error occurred, or false otherwise.
@@ -325,30 +860,32 @@ bool read_requesthdrs(client_info *client, rio_t *rp, parser_t *parser) {
 }
 
 /*
- * serve - handle one HTTP request/response transaction
+ * keep_connection - decide whether the connection outlives this request
+ *
+ * HTTP/1.1 connections persist unless the client asks to close them,
+ * HTTP/1.0 ones only if the client asks to keep them alive.
  */
-void serve(client_info *client) {
-    // Get some extra info about the client (hostname/port)
-    // This is optional, but it's nice to know who's connected
-    int res = getnameinfo(
-            (SA *) &client->addr, client->addrlen,
-            client->host, sizeof(client->host),
-            client->serv, sizeof(client->serv),
-            0);
-    if (res == 0) {
-        printf("Accepted connection from %s:%s\n", client->host, client->serv);
+bool keep_connection(parser_t *parser) {
+    const char *version;
+    if (!keepalive || parser_retrieve(parser, HTTP_VERSION, &version) < 0) {
+        return false;
     }
-    else {
-        fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
+    header_t *header = parser_lookup_header(parser, "Connection");
+    if (strcmp(version, "1.1") == 0) {
+        return header == NULL || strcasecmp(header->value, "close") != 0;
     }
+    return header != NULL && strcasecmp(header->value, "keep-alive") == 0;
+}
 
-    rio_t rio;
-    rio_readinitb(&rio, client->connfd);
-
+/*
+ * serve - handle one HTTP request/response transaction
+ * Returns true if the connection stays open for another request.
+ */
+bool serve(client_info *client, rio_t *rp) {
     /* Read request line */
     char buf[MAXLINE];
-    if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0) {
-        return;
+    if (rio_readlineb(rp, buf, sizeof(buf)) <= 0) {
+        return false;
     }
 
     printf("%s", buf);
@@ -362,7 +899,7 @@ void serve(client_info *client) {
         parser_free(parser);
 	    clienterror(client->connfd, "400", "Bad Request",
 		    "Tiny received a malformed request");
-	    return;
+	    return false;
     }
 
     /* Tiny only cares about METHOD and PATH from the request */
@@ -375,13 +912,23 @@ void serve(client_info *client) {
 	    parser_free(parser);
     	clienterror(client->connfd, "501", "Not Implemented",
 		    "Tiny does not implement this method");
-    	return;
+    	return false;
     }
 
     /* Check if reading request headers caused an error */
-    if (read_requesthdrs(client, &rio, parser)) {
+    if (read_requesthdrs(client, rp, parser)) {
+        parser_free(parser);
+	    return false;
+    }
+
+    /* Synthetic objects, whatever form of PATH the parser hands out */
+    const char *gen = path + (path[0] == '/');
+    if (strncmp(gen, "gen", 3) == 0 && (gen[3] == '?' || gen[3] == '\0')) {
+        bool keep = keep_connection(parser);
+        serve_gen(client->connfd, gen[3] == '?' ? gen + 4 : "", parser,
+                  keep);
         parser_free(parser);
-	    return;
+        return keep;
     }
 
     /* Parse URI from GET request */
@@ -391,59 +938,152 @@ void serve(client_info *client) {
 	    parser_free(parser);
         clienterror(client->connfd, "400", "Bad Request",
                     "Tiny could not parse the request URI");
-        return;
+        return false;
+    }
+
+    if (result == PARSE_STATIC) { /* Serve static content */
+        open_file *file = file_get(filename);
+        if (file == NULL && errno == ENOENT) {
+            parser_free(parser);
+            clienterror(client->connfd, "404", "Not found",
+                        "Tiny couldn't find this file");
+            return false;
+        }
+        if (file == NULL) {
+            parser_free(parser);
+	    clienterror(client->connfd, "403", "Forbidden",
+                        "Tiny couldn't read the file");
+            return false;
+        }
+        bool keep = keep_connection(parser);
+        serve_static(client->connfd, file, parser, keep);
+        file_release(file);
+        parser_free(parser);
+        return keep;
     }
 
-    /* Attempt to stat the file */
+    /* Serve dynamic content; attempt to stat the program */
     struct stat sbuf;
     if (stat(filename, &sbuf) < 0) {
     	parser_free(parser);
 	    clienterror(client->connfd, "404", "Not found",
                     "Tiny couldn't find this file");
-        return;
+        return false;
     }
-
-    if (result == PARSE_STATIC) { /* Serve static content */
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            parser_free(parser);
-	    clienterror(client->connfd, "403", "Forbidden",
-                        "Tiny couldn't read the file");
-            return;
-        }
-        serve_static(client->connfd, filename, sbuf.st_size);
-    } else { /* Serve dynamic content */
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
- 	    parser_free(parser);
-     	    clienterror(client->connfd, "403", "Forbidden",
-                        "Tiny couldn't run the CGI program");
-            return;
-        }
-        serve_dynamic(client->connfd, filename, cgiargs);
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+        parser_free(parser);
+        clienterror(client->connfd, "403", "Forbidden",
+                    "Tiny couldn't run the CGI program");
+        return false;
     }
+    /* The CGI output has no length, only closing can delimit it */
+    serve_dynamic(client->connfd, filename, cgiargs);
 
     parser_free(parser);
+    return false;
+}
+
+/*
+ * serve_connection - serve requests on a connection until it is closed
+ */
+void serve_connection(client_info *client) {
+    // Get some extra info about the client (hostname/port)
+    // This is optional, but it's nice to know who's connected
+    int res = getnameinfo(
+            (SA *) &client->addr, client->addrlen,
+            client->host, sizeof(client->host),
+            client->serv, sizeof(client->serv),
+            0);
+    if (res == 0) {
+        printf("Accepted connection from %s:%s\n", client->host, client->serv);
+    }
+    else {
+        fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
+    }
+
+    /* Idle persistent connections give up their thread eventually */
+    if (keepalive) {
+        struct timeval timeout = { KEEPALIVE_TIMEOUT, 0 };
+        setsockopt(client->connfd, SOL_SOCKET, SO_RCVTIMEO,
+                   &timeout, sizeof(timeout));
+    }
+
+    /* One buffer for the connection, a client may pipeline requests */
+    rio_t rio;
+    rio_readinitb(&rio, client->connfd);
+    while (serve(client, &rio)) {
+        ;
+    }
+}
+
+/*
+ * serve_thread - serve one connection on its own thread
+ */
+void *serve_thread(void *vargp) {
+    client_info *client = (client_info *) vargp;
+
+    pthread_detach(pthread_self());
+    serve_connection(client);
+    close(client->connfd);
+    free(client);
+    return NULL;
 }
 
 int main(int argc, char **argv) {
     int listenfd;
+    int opt;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "tkw:")) != -1) {
+        switch (opt) {
+        case 't':
+            concurrent = true;
+            break;
+        case 'k':
+            keepalive = true;
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            if (nworkers < 1 || nworkers > MAX_WORKERS) {
+                argc = 0;
+            }
+            break;
+        default:
+            argc = 0;
+            break;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: %s [-t] [-k] [-w workers] <port>\n",
+                argv[0]);
         exit(1);
     }
 
+    /* A client closing early must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Workers start before the listening socket exists, so they lack it */
+    if (nworkers > 0) {
+        cgi_start_pools();
+        /* Reap workers that exit from now on, and any that already did */
+        Signal(SIGCHLD, cgi_reap);
+        cgi_reap(SIGCHLD);
+    }
+
     // Open listening file descriptor
-    listenfd = open_listenfd(argv[1]);
+    listenfd = open_listenfd(argv[optind]);
     if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
+        fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
         exit(1);
     }
 
     while (1) {
-        /* Allocate space on the stack for client info */
+        /* Threads need client info of their own on the heap */
         client_info client_data;
         client_info *client = &client_data;
+        if (concurrent) {
+            client = malloc(sizeof(client_info));
+        }
 
         /* Initialize the length of the address */
         client->addrlen = sizeof(client->addr);
@@ -453,11 +1093,23 @@ int main(int argc, char **argv) {
                 (SA *) &client->addr, &client->addrlen);
         if (client->connfd < 0) {
             perror("accept");
+            if (concurrent) {
+                free(client);
+            }
             continue;
         }
 
         /* Connection is established; serve client */
-        serve(client);
+        if (concurrent) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, serve_thread, client) != 0) {
+                fprintf(stderr, "pthread_create failed\n");
+                close(client->connfd);
+                free(client);
+            }
+            continue;
+        }
+        serve_connection(client);
         close(client->connfd);
     }
 }
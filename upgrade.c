@@ -0,0 +1,178 @@
+/**
+ * @file upgrade.c
+ * @brief Hand the listening sockets to a new proxy binary over SCM_RIGHTS
+ */
+
+#include "upgrade.h"
+#include "listener.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * control_addr - fill in a Unix socket address, -1 if the path is too long
+ */
+static int control_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "upgrade: control path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/*
+ * send_fds - send descriptors along with a single data byte
+ */
+static int send_fds(int sock, const int fds[], int n) {
+    char byte = 'L';
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+/*
+ * recv_fds - receive descriptors sent by send_fds, returns their number
+ */
+static int recv_fds(int sock, int fds[], int max) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(sock, &msg, 0) != 1) {
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (n > max) {
+        n = max;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+    return n;
+}
+
+/**
+ * The function asks a running proxy for its listening sockets.
+ *
+ * @param path The control socket path.
+ * @param fds Receives the listening file descriptors.
+ * @param max The size of fds.
+ *
+ * @return the number of sockets received, or -1 if no proxy answered.
+ */
+int upgrade_takeover(const char *path, int fds[], int max) {
+    struct sockaddr_un addr;
+    int sock, n;
+
+    if (control_addr(&addr, path) < 0) {
+        return -1;
+    }
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    /*no proxy running, or a stale socket file*/
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    n = recv_fds(sock, fds, max);
+    close(sock);
+    return n;
+}
+
+/**
+ * The function creates the control socket, replacing any stale one.
+ *
+ * @param path The control socket path.
+ *
+ * @return the control file descriptor, or -1 on error.
+ */
+int upgrade_listen(const char *path) {
+    struct sockaddr_un addr;
+    int ctlfd;
+
+    if (control_addr(&addr, path) < 0) {
+        return -1;
+    }
+    ctlfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctlfd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(ctlfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(ctlfd, 1) < 0) {
+        fprintf(stderr, "upgrade: bind %s failed: %s\n", path,
+                strerror(errno));
+        close(ctlfd);
+        return -1;
+    }
+    return ctlfd;
+}
+
+/**
+ * The function waits for a successor on the control socket and sends it the
+ * listening sockets. Before they are sent, prepare is called so the old
+ * process can flush state the successor will load, such as the snapshot.
+ *
+ * @param ctlfd The control socket from upgrade_listen().
+ * @param fds The listening sockets to hand over.
+ * @param n The number of sockets, at most MAX_LISTENERS.
+ * @param prepare Called once a successor has connected, may be NULL.
+ *
+ * @return 0 once the sockets have been handed over, -1 on error.
+ */
+int upgrade_handoff(int ctlfd, const int fds[], int n, void (*prepare)(void)) {
+    int sock, rc;
+
+    while ((sock = accept(ctlfd, NULL, NULL)) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (prepare != NULL) {
+        prepare();
+    }
+    rc = send_fds(sock, fds, n);
+    close(sock);
+    return rc;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file upgrade.h
+ * @brief Definitions and interfaces for upgrade.c
+ *
+ * A running proxy listens on a Unix domain control socket. A newly started
+ * proxy given the same control path connects to it and receives the
+ * listening sockets with SCM_RIGHTS, so both processes accept from the same
+ * kernel queues until the old one has drained.
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/**
+ * The function asks a running proxy for its listening sockets.
+ *
+ * @param path The control socket path.
+ * @param fds Receives the listening file descriptors.
+ * @param max The size of fds.
+ *
+ * @return the number of sockets received, or -1 if no proxy answered.
+ */
+int upgrade_takeover(const char *path, int fds[], int max);
+
+/**
+ * The function creates the control socket, replacing any stale one.
+ *
+ * @param path The control socket path.
+ *
+ * @return the control file descriptor, or -1 on error.
+ */
+int upgrade_listen(const char *path);
+
+/**
+ * The function waits for a successor on the control socket and sends it the
+ * listening sockets. Before they are sent, prepare is called so the old
+ * process can flush state the successor will load, such as the snapshot.
+ *
+ * @param ctlfd The control socket from upgrade_listen().
+ * @param fds The listening sockets to hand over.
+ * @param n The number of sockets, at most MAX_LISTENERS.
+ * @param prepare Called once a successor has connected, may be NULL.
+ *
+ * @return 0 once the sockets have been handed over, -1 on error.
+ */
+int upgrade_handoff(int ctlfd, const int fds[], int n, void (*prepare)(void));
+
+#endif /* UPGRADE_H */
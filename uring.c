@@ -0,0 +1,567 @@
+/**
+ * @file uring.c
+ * @brief io_uring engine for accepting and relaying
+ *
+ * Each ring is a submission and a completion queue shared with the kernel
+ * through one mapping, plus the array of submission entries. Entries are
+ * filled in locally and handed over by publishing the queue tail in
+ * ring_enter(), which also waits for completions.
+ *
+ * Relay rings are kept in a pool so that connection threads do not pay for
+ * setting one up on every request. Every relay ring owns RELAY_BUFS
+ * receive buffers, registered as buffer group 0, and two fixed file slots
+ * that hold the origin and client sockets while a response is relayed. A
+ * buffer goes back to the buffer ring once its chunk has been sent. Sends
+ * to the client are never in flight alongside another chain of sends, so
+ * the chunks arrive in order even when a send has to wait for the socket.
+ *
+ * Requires Linux 6.0 for multishot receives.
+ */
+
+/* syscall() and the mmap flags are not in X/Open */
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*submission entries of a relay ring, enough for a chain of every buffer*/
+#define RELAY_ENTRIES 16
+/*provided receive buffers per relay ring, a power of two*/
+#define RELAY_BUFS 8
+#define RELAY_BUF_SIZE (16 * 1024)
+/*idle relay rings kept for reuse*/
+#define RING_POOL_MAX 256
+#define ACCEPT_ENTRIES 8
+
+/*fixed file slots of a relay ring*/
+#define SLOT_SERVER 0
+#define SLOT_CLIENT 1
+
+/*what a completion belongs to, a buffer id is kept above the low byte*/
+enum {
+    OP_ACCEPT,
+    OP_WAKE,
+    OP_CANCEL,
+    OP_REQUEST,
+    OP_RECV,
+    OP_SEND,
+};
+
+/*one io_uring instance and its mappings*/
+typedef struct Ring {
+    int fd;                       /*the ring itself*/
+    void *queues;                 /*submission and completion queues*/
+    size_t queues_length;         /*length of their mapping*/
+    struct io_uring_sqe *sqes;    /*submission entries*/
+    size_t sqes_length;           /*length of their mapping*/
+    unsigned *sq_tail;            /*shared submission tail*/
+    unsigned sq_mask;             /*entries - 1*/
+    unsigned tail;                /*local tail, published on enter*/
+    unsigned queued;              /*entries filled in since then*/
+    unsigned *cq_head;            /*shared completion head*/
+    unsigned *cq_tail;            /*shared completion tail*/
+    unsigned cq_mask;             /*completion entries - 1*/
+    struct io_uring_cqe *cqes;    /*completion entries*/
+    struct io_uring_buf_ring *br; /*provided buffer ring, or NULL*/
+    char *bufs;                   /*the buffers it provides*/
+    unsigned short br_tail;       /*local tail of the buffer ring*/
+    struct Ring *next;            /*pool links*/
+} ring_t;
+
+static ring_t *pool = NULL;
+static int pool_size = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL,
+                        0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/*
+ * ring_free - unmap and close a ring, cancelling anything still in flight
+ */
+static void ring_free(ring_t *ring) {
+    if (ring->br != NULL) {
+        munmap(ring->br, RELAY_BUFS * sizeof(struct io_uring_buf));
+        free(ring->bufs);
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_length);
+    }
+    if (ring->queues != NULL) {
+        munmap(ring->queues, ring->queues_length);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+/*
+ * ring_new - set up a ring and map its queues
+ */
+static ring_t *ring_new(unsigned entries) {
+    struct io_uring_params params;
+    ring_t *ring = calloc(1, sizeof(ring_t));
+    char *queues;
+    size_t sq_length, cq_length;
+
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(&params, 0, sizeof(params));
+    if ((ring->fd = sys_setup(entries, &params)) < 0) {
+        free(ring);
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring_free(ring);
+        return NULL;
+    }
+    sq_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_length = params.cq_off.cqes +
+                params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->queues_length = sq_length > cq_length ? sq_length : cq_length;
+    queues = mmap(NULL, ring->queues_length, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (queues == MAP_FAILED) {
+        ring_free(ring);
+        return NULL;
+    }
+    ring->queues = queues;
+    ring->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_length, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        ring_free(ring);
+        return NULL;
+    }
+
+    ring->sq_tail = (unsigned *)(queues + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(queues + params.sq_off.ring_mask);
+    ring->tail = *ring->sq_tail;
+    /*entry i always sits in slot i of the submission queue*/
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        ((unsigned *)(queues + params.sq_off.array))[i] = i;
+    }
+    ring->cq_head = (unsigned *)(queues + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(queues + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(queues + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(queues + params.cq_off.cqes);
+    return ring;
+}
+
+/*
+ * ring_sqe - the next free submission entry, cleared
+ */
+static struct io_uring_sqe *ring_sqe(ring_t *ring, int fd, unsigned op,
+                                     uint64_t data) {
+    struct io_uring_sqe *sqe = &ring->sqes[ring->tail & ring->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    ring->tail++;
+    ring->queued++;
+    return sqe;
+}
+
+/*
+ * ring_enter - submit the queued entries and wait for a completion
+ */
+static int ring_enter(ring_t *ring) {
+    unsigned submit = ring->queued;
+    int rc;
+
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+    ring->queued = 0;
+    do {
+        rc = sys_enter(ring->fd, submit, 1, IORING_ENTER_GETEVENTS);
+    } while (rc < 0 && errno == EINTR);
+    return rc < 0 ? -1 : 0;
+}
+
+/*
+ * ring_cqe - the oldest completion not yet seen, or NULL
+ */
+static struct io_uring_cqe *ring_cqe(ring_t *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+static void ring_cqe_seen(ring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * buf_recycle - hand a receive buffer back to the kernel
+ */
+static void buf_recycle(ring_t *ring, unsigned bid) {
+    struct io_uring_buf *buf =
+        &ring->br->bufs[ring->br_tail & (RELAY_BUFS - 1)];
+
+    buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * RELAY_BUF_SIZE);
+    buf->len = RELAY_BUF_SIZE;
+    buf->bid = bid;
+    ring->br_tail++;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * relay_ring_new - a ring with receive buffers and two fixed file slots
+ */
+static ring_t *relay_ring_new(void) {
+    struct io_uring_buf_reg reg;
+    int slots[2] = {-1, -1};
+    ring_t *ring = ring_new(RELAY_ENTRIES);
+
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->br = mmap(NULL, RELAY_BUFS * sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                    0);
+    ring->bufs = malloc((size_t)RELAY_BUFS * RELAY_BUF_SIZE);
+    if (ring->br == MAP_FAILED || ring->bufs == NULL) {
+        if (ring->br == MAP_FAILED) {
+            ring->br = NULL;
+        }
+        free(ring->bufs);
+        ring_free(ring);
+        return NULL;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->br;
+    reg.ring_entries = RELAY_BUFS;
+    reg.bgid = 0;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ||
+        sys_register(ring->fd, IORING_REGISTER_FILES, slots, 2) < 0) {
+        ring_free(ring);
+        return NULL;
+    }
+    for (unsigned bid = 0; bid < RELAY_BUFS; bid++) {
+        buf_recycle(ring, bid);
+    }
+    return ring;
+}
+
+/*
+ * ring_get - take a relay ring from the pool, or set up a new one
+ */
+static ring_t *ring_get(void) {
+    ring_t *ring;
+
+    pthread_mutex_lock(&pool_lock);
+    ring = pool;
+    if (ring != NULL) {
+        pool = ring->next;
+        pool_size--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return ring != NULL ? ring : relay_ring_new();
+}
+
+/*
+ * ring_put - return an idle relay ring to the pool
+ */
+static void ring_put(ring_t *ring) {
+    pthread_mutex_lock(&pool_lock);
+    if (pool_size < RING_POOL_MAX) {
+        ring->next = pool;
+        pool = ring;
+        pool_size++;
+        ring = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (ring != NULL) {
+        ring_free(ring);
+    }
+}
+
+/*
+ * set_files - fill the fixed file slots, -1 empties them
+ */
+static int set_files(ring_t *ring, int server_fd, int client_fd) {
+    int fds[2] = {server_fd, client_fd};
+    struct io_uring_files_update update;
+
+    memset(&update, 0, sizeof(update));
+    update.offset = SLOT_SERVER;
+    update.fds = (uintptr_t)fds;
+    return sys_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 2) ==
+                   2
+               ? 0
+               : -1;
+}
+
+/**
+ * The function checks that the kernel supports everything the engine uses.
+ *
+ * @return 0 if the engine can be used, -1 otherwise.
+ */
+int uring_init(void) {
+    ring_t *ring = relay_ring_new();
+
+    if (ring == NULL) {
+        return -1;
+    }
+    ring_put(ring);
+    return 0;
+}
+
+/*
+ * prep_accept - arm the multishot accept on the listening socket
+ */
+static void prep_accept(ring_t *ring) {
+    struct io_uring_sqe *sqe = ring_sqe(ring, 0, IORING_OP_ACCEPT, OP_ACCEPT);
+
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/**
+ * The function accepts connections on a listening socket until the wake file
+ * descriptor becomes readable and the stop flag is set.
+ *
+ * @param listenfd The listening socket.
+ * @param wakefd The read end of the shutdown pipe.
+ * @param stopping Set when the loop should return.
+ * @param accepted Starts each new connection.
+ *
+ * @return 0 once stopped, -1 if the ring could not be set up.
+ */
+int uring_accept_loop(int listenfd, int wakefd, volatile int *stopping,
+                      uring_accepted_t accepted) {
+    ring_t *ring = ring_new(ACCEPT_ENTRIES);
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    bool accepting = true;
+
+    if (ring == NULL) {
+        return -1;
+    }
+    if (sys_register(ring->fd, IORING_REGISTER_FILES, &listenfd, 1) < 0) {
+        ring_free(ring);
+        return -1;
+    }
+    prep_accept(ring);
+    sqe = ring_sqe(ring, wakefd, IORING_OP_POLL_ADD, OP_WAKE);
+    sqe->poll32_events = POLLIN;
+
+    /*after shutdown starts, run until the accept has been cancelled*/
+    while (accepting) {
+        if (ring_enter(ring) < 0) {
+            break;
+        }
+        while ((cqe = ring_cqe(ring)) != NULL) {
+            int res = cqe->res;
+            bool more = cqe->flags & IORING_CQE_F_MORE;
+
+            switch (cqe->user_data) {
+            case OP_ACCEPT:
+                if (res >= 0) {
+                    accepted(res);
+                } else if (res != -EAGAIN && res != -ECANCELED) {
+                    errno = -res;
+                    perror("accept");
+                }
+                if (!more && *stopping) {
+                    accepting = false;
+                } else if (!more) {
+                    prep_accept(ring);
+                }
+                break;
+            case OP_WAKE:
+                if (*stopping) {
+                    sqe = ring_sqe(ring, 0, IORING_OP_ASYNC_CANCEL, OP_CANCEL);
+                    sqe->addr = OP_ACCEPT;
+                } else {
+                    sqe = ring_sqe(ring, wakefd, IORING_OP_POLL_ADD, OP_WAKE);
+                    sqe->poll32_events = POLLIN;
+                }
+                break;
+            default:
+                break;
+            }
+            ring_cqe_seen(ring);
+        }
+    }
+    ring_free(ring);
+    return 0;
+}
+
+/*
+ * prep_recv - arm the multishot receive from the origin
+ */
+static void prep_recv(ring_t *ring) {
+    struct io_uring_sqe *sqe =
+        ring_sqe(ring, SLOT_SERVER, IORING_OP_RECV, OP_RECV);
+
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = 0;
+}
+
+/*
+ * prep_send - queue a send on a fixed file
+ */
+static struct io_uring_sqe *prep_send(ring_t *ring, int slot, const void *buf,
+                                      size_t length, uint64_t data) {
+    struct io_uring_sqe *sqe = ring_sqe(ring, slot, IORING_OP_SEND, data);
+
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = length;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    return sqe;
+}
+
+/**
+ * The function sends a request to the origin and relays the response to the
+ * client until the origin closes the connection.
+ *
+ * @param server_fd The origin connection.
+ * @param client_fd The client connection.
+ * @param request The request to send to the origin.
+ * @param length The length of the request.
+ * @param copy Receives the start of the response, for the cache.
+ * @param size The size of copy; chunks past it are not copied.
+ * @param progress Called for every chunk received.
+ * @param arg Passed to progress.
+ *
+ * @return the number of bytes received, or -1 if no ring was available and
+ * nothing was sent.
+ */
+ssize_t uring_relay(int server_fd, int client_fd, const char *request,
+                    size_t length, char *copy, size_t size,
+                    uring_progress_t progress, void *arg) {
+    ring_t *ring = ring_get();
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe = NULL;
+    /*chunks waiting for the sends in flight, oldest first*/
+    unsigned queue_bid[RELAY_BUFS], queue_len[RELAY_BUFS];
+    unsigned queued = 0, sending = 0;
+    bool requesting = true, receiving = true, rearm = false;
+    bool client_ok = true, broken = false;
+    size_t received = 0;
+
+    if (ring == NULL) {
+        return -1;
+    }
+    if (set_files(ring, server_fd, client_fd) < 0) {
+        ring_free(ring);
+        return -1;
+    }
+    sqe = prep_send(ring, SLOT_SERVER, request, length, OP_REQUEST);
+    sqe->flags |= IOSQE_IO_LINK;
+    prep_recv(ring);
+
+    while (requesting || receiving || rearm || queued + sending > 0) {
+        /*out of buffers earlier, resume once one has been returned*/
+        if (rearm && queued + sending < RELAY_BUFS) {
+            rearm = false;
+            receiving = true;
+            prep_recv(ring);
+        }
+        /*the previous chain is done, send everything that came since*/
+        if (sending == 0 && queued > 0) {
+            for (unsigned i = 0; i < queued; i++) {
+                sqe = prep_send(ring, SLOT_CLIENT,
+                                ring->bufs +
+                                    (size_t)queue_bid[i] * RELAY_BUF_SIZE,
+                                queue_len[i], OP_SEND | queue_bid[i] << 8);
+                if (i + 1 < queued) {
+                    sqe->flags |= IOSQE_IO_LINK;
+                }
+            }
+            sending = queued;
+            queued = 0;
+        }
+        if (ring_enter(ring) < 0) {
+            broken = true;
+            break;
+        }
+        while ((cqe = ring_cqe(ring)) != NULL) {
+            int res = cqe->res;
+            unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            switch (cqe->user_data & 0xff) {
+            case OP_REQUEST:
+                requesting = false;
+                break;
+            case OP_RECV:
+                if (res > 0) {
+                    progress(arg, received);
+                    if (received + res <= size) {
+                        memcpy(copy + received,
+                               ring->bufs + (size_t)bid * RELAY_BUF_SIZE,
+                               res);
+                    }
+                    received += res;
+                    if (client_ok) {
+                        queue_bid[queued] = bid;
+                        queue_len[queued++] = res;
+                    } else {
+                        buf_recycle(ring, bid);
+                    }
+                }
+                /*
+                 * A multishot receive can end on a chunk of data, not only
+                 * on end of file; only 0 or a hard error ends the response.
+                 */
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    receiving = false;
+                    rearm = res > 0 || res == -ENOBUFS;
+                }
+                break;
+            case OP_SEND:
+                sending--;
+                if (res < 0) {
+                    client_ok = false;
+                }
+                buf_recycle(ring, cqe->user_data >> 8);
+                break;
+            default:
+                break;
+            }
+            ring_cqe_seen(ring);
+        }
+        /*the client is gone, keep reading the object for the cache only*/
+        while (!client_ok && queued > 0) {
+            buf_recycle(ring, queue_bid[--queued]);
+        }
+    }
+    if (broken || set_files(ring, -1, -1) < 0) {
+        ring_free(ring);
+    } else {
+        ring_put(ring);
+    }
+    return received;
+}
@@ -0,0 +1,76 @@
+/**
+ * @file uring.h
+ * @brief Definitions and interfaces for uring.c
+ *
+ * An optional io_uring engine for the proxy's network I/O (proxy -U). The
+ * request handling stays the same; the engine takes over the two loops that
+ * make the most system calls:
+ *
+ * - accepting, with one multishot accept on the listening socket, which is
+ *   registered as a fixed file, so a single io_uring_enter() can return many
+ *   new connections;
+ *
+ * - relaying a response from the origin, where the request is sent linked to
+ *   a multishot receive that fills buffers from a provided buffer ring, and
+ *   chunks are sent to the client as chains of linked sends while the next
+ *   ones arrive. Both sockets are fixed files for the duration.
+ *
+ * Rings are set up with raw system calls, no liburing is needed. Reading the
+ * request headers from the client is left to rio, it is a single read for
+ * almost every request.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*called for every chunk received from the origin, with the bytes so far*/
+typedef void (*uring_progress_t)(void *arg, size_t received);
+
+/*called for every accepted connection*/
+typedef void (*uring_accepted_t)(int connfd);
+
+/**
+ * The function checks that the kernel supports everything the engine uses.
+ *
+ * @return 0 if the engine can be used, -1 otherwise.
+ */
+int uring_init(void);
+
+/**
+ * The function accepts connections on a listening socket until the wake file
+ * descriptor becomes readable and the stop flag is set.
+ *
+ * @param listenfd The listening socket.
+ * @param wakefd The read end of the shutdown pipe.
+ * @param stopping Set when the loop should return.
+ * @param accepted Starts each new connection.
+ *
+ * @return 0 once stopped, -1 if the ring could not be set up.
+ */
+int uring_accept_loop(int listenfd, int wakefd, volatile int *stopping,
+                      uring_accepted_t accepted);
+
+/**
+ * The function sends a request to the origin and relays the response to the
+ * client until the origin closes the connection.
+ *
+ * @param server_fd The origin connection.
+ * @param client_fd The client connection.
+ * @param request The request to send to the origin.
+ * @param length The length of the request.
+ * @param copy Receives the start of the response, for the cache.
+ * @param size The size of copy; chunks past it are not copied.
+ * @param progress Called for every chunk received.
+ * @param arg Passed to progress.
+ *
+ * @return the number of bytes received, or -1 if no ring was available and
+ * nothing was sent.
+ */
+ssize_t uring_relay(int server_fd, int client_fd, const char *request,
+                    size_t length, char *copy, size_t size,
+                    uring_progress_t progress, void *arg);
+
+#endif /* URING_H */
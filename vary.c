@@ -0,0 +1,168 @@
+/**
+ * @file vary.c
+ * @brief Vary header parsing and variant keys
+ */
+
+#include "vary.h"
+
+#include <string.h>
+#include <strings.h>
+
+/*
+ * append - append bytes to a NUL-terminated buffer, -1 if they do not fit
+ */
+static int append(char *buf, size_t *length, size_t size, const char *bytes,
+                  size_t n) {
+    if (*length + n + 1 > size) {
+        return -1;
+    }
+    memcpy(buf + *length, bytes, n);
+    *length += n;
+    buf[*length] = '\0';
+    return 0;
+}
+
+/*
+ * trim - skip the spaces and tabs around [*start, *end)
+ */
+static void trim(const char **start, const char **end) {
+    while (*start < *end && (**start == ' ' || **start == '\t')) {
+        (*start)++;
+    }
+    while (*end > *start && ((*end)[-1] == ' ' || (*end)[-1] == '\t')) {
+        (*end)--;
+    }
+}
+
+/*
+ * add_names - append the comma-separated names of one Vary header
+ */
+static int add_names(const char *p, const char *end, char *names,
+                     size_t *length, size_t size) {
+    while (p < end) {
+        const char *comma = memchr(p, ',', end - p);
+        const char *start = p, *stop = comma != NULL ? comma : end;
+
+        p = stop + 1;
+        trim(&start, &stop);
+        if (start == stop) {
+            continue;
+        }
+        if (stop - start == 1 && *start == '*') {
+            return -1;
+        }
+        if (*length > 0) {
+            char separator = VARY_SEPARATOR;
+            if (append(names, length, size, &separator, 1) < 0) {
+                return -1;
+            }
+        }
+        for (; start < stop; start++) {
+            char c = *start >= 'A' && *start <= 'Z' ? *start - 'A' + 'a'
+                                                     : *start;
+            if (append(names, length, size, &c, 1) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * The function collects the header names of the Vary headers in a response.
+ *
+ * @param response The response, status line and headers first.
+ * @param length The length of the response.
+ * @param names Receives the names, lowercased and separated by
+ * VARY_SEPARATOR.
+ * @param size The size of names.
+ *
+ * @return 1 if the response varies, 0 if it does not, -1 if it cannot be
+ * cached: "Vary: *", or the names do not fit.
+ */
+int vary_names(const char *response, size_t length, char *names, size_t size) {
+    const char *end = response + length;
+    const char *line = memchr(response, '\n', length);
+    size_t used = 0;
+
+    if (size == 0) {
+        return -1;
+    }
+    names[0] = '\0';
+    /*every header line, up to the blank line ending them*/
+    while (line != NULL && ++line < end && *line != '\r' && *line != '\n') {
+        const char *eol = memchr(line, '\n', end - line);
+        const char *stop = eol != NULL ? eol : end;
+
+        if (stop - line > 5 && strncasecmp(line, "Vary:", 5) == 0 &&
+            add_names(line + 5, stop[-1] == '\r' ? stop - 1 : stop, names,
+                      &used, size) < 0) {
+            return -1;
+        }
+        line = eol;
+    }
+    return used > 0;
+}
+
+/*
+ * find_header - the first request header with a name, ignoring case
+ */
+static const header_t *find_header(header_t *const *headers, int nheaders,
+                                   const char *name, size_t n) {
+    for (int i = 0; i < nheaders; i++) {
+        if (strlen(headers[i]->name) == n &&
+            strncasecmp(headers[i]->name, name, n) == 0) {
+            return headers[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The function builds the variant key of a request. Header names are
+ * matched case-insensitively, whatever the spelling the client used.
+ *
+ * @param key The cache key of the URI.
+ * @param names The header names from vary_names().
+ * @param headers The request headers, as the parser returned them.
+ * @param nheaders The number of request headers, which may be more than
+ * VARY_MAX_HEADERS.
+ * @param variant Receives the variant key.
+ * @param size The size of variant.
+ *
+ * @return 0 on success, -1 if the key does not fit or the request had more
+ * than VARY_MAX_HEADERS headers.
+ */
+int vary_key(const char *key, const char *names, header_t *const *headers,
+             int nheaders, char *variant, size_t size) {
+    char separator = VARY_SEPARATOR;
+    size_t length = 0;
+
+    /*a header that was not kept could be one the object varies on*/
+    if (size == 0 || nheaders > VARY_MAX_HEADERS) {
+        return -1;
+    }
+    variant[0] = '\0';
+    if (append(variant, &length, size, key, strlen(key)) < 0) {
+        return -1;
+    }
+    while (*names != '\0') {
+        size_t n = strcspn(names, "\n");
+        const header_t *header = find_header(headers, nheaders, names, n);
+
+        names += names[n] != '\0' ? n + 1 : n;
+        /*a missing header is an empty value*/
+        if (append(variant, &length, size, &separator, 1) < 0) {
+            return -1;
+        }
+        if (header != NULL && header->value != NULL) {
+            const char *start = header->value;
+            const char *stop = start + strlen(start);
+            trim(&start, &stop);
+            if (append(variant, &length, size, start, stop - start) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file vary.h
+ * @brief Definitions and interfaces for vary.c
+ *
+ * A response with a Vary header is only valid for requests that send the
+ * same values for the headers it names. Such responses are cached as
+ * variants: the URI's own cache entry is a vary marker listing the header
+ * names, and each variant is stored under a key made of the URI and the
+ * request's values for those headers. A lookup finds the marker, builds the
+ * variant key from the request and looks that up, two hash lookups whatever
+ * the number of variants.
+ */
+
+#ifndef VARY_H
+#define VARY_H
+
+#include <stddef.h>
+
+#include "http_parser.h"
+
+/* Separates the URI and the header values in a variant key */
+#define VARY_SEPARATOR '\n'
+/* Most request headers a variant key can be built from */
+#define VARY_MAX_HEADERS 64
+
+/**
+ * The function collects the header names of the Vary headers in a response.
+ *
+ * @param response The response, status line and headers first.
+ * @param length The length of the response.
+ * @param names Receives the names, lowercased and separated by
+ * VARY_SEPARATOR.
+ * @param size The size of names.
+ *
+ * @return 1 if the response varies, 0 if it does not, -1 if it cannot be
+ * cached: "Vary: *", or the names do not fit.
+ */
+int vary_names(const char *response, size_t length, char *names, size_t size);
+
+/**
+ * The function builds the variant key of a request. Header names are
+ * matched case-insensitively, whatever the spelling the client used.
+ *
+ * @param key The cache key of the URI.
+ * @param names The header names from vary_names().
+ * @param headers The request headers, as the parser returned them.
+ * @param nheaders The number of request headers, which may be more than
+ * VARY_MAX_HEADERS.
+ * @param variant Receives the variant key.
+ * @param size The size of variant.
+ *
+ * @return 0 on success, -1 if the key does not fit or the request had more
+ * than VARY_MAX_HEADERS headers.
+ */
+int vary_key(const char *key, const char *names, header_t *const *headers,
+             int nheaders, char *variant, size_t size);
+
+#endif /* VARY_H */